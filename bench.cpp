@@ -0,0 +1,566 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include "webp/webp.h"
+
+/*
+ * Замер производительности стадий кодировщика и декодера на синтетическом корпусе, который строится в процессе
+ * детерминированным генератором, поэтому цифры разных сборок и машин сравнимы между собой.
+ * Для каждой стадии печатаются минимум и медиана по повторам, MB/s и ns на пиксель, для построения кодов Хаффмана -
+ * время на одну таблицу
+ */
+
+using namespace webp;
+
+//результаты стадий складываются сюда, чтобы компилятор не выбросил замеряемый код
+static volatile uint32_t g_checksum = 0;
+
+//линейный конгруэнтный генератор, чтобы корпус не зависел от реализации rand()
+class Random
+{
+private:
+	uint32_t	m_state;
+public:
+	Random(const uint32_t & seed)
+		: m_state(seed)
+	{
+
+	}
+	uint32_t next()
+	{
+		m_state = m_state * 1664525u + 1013904223u;
+		return m_state >> 8;
+	}
+	uint32_t next(const uint32_t & n)
+	{
+		return next() % n;
+	}
+};
+
+struct corpus_image_t
+{
+	std::string			name;
+	uint32_t			width;
+	uint32_t			height;
+	utils::pixel_array	argb;
+	corpus_image_t(const std::string & _name, const uint32_t & _width, const uint32_t & _height)
+		: name(_name), width(_width), height(_height), argb(_width * _height)
+	{
+
+	}
+	void fill_rect(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h, const uint32_t & color)
+	{
+		for(uint32_t y = y0; y < y0 + h && y < height; y++)
+			for(uint32_t x = x0; x < x0 + w && x < width; x++)
+				argb[y * width + x] = color;
+	}
+};
+
+void make_gradient(corpus_image_t & image)
+{
+	for(uint32_t y = 0; y < image.height; y++)
+		for(uint32_t x = 0; x < image.width; x++)
+			image.argb[y * image.width + x] = 0xff000000 | ((x * 255 / image.width) << 16) |
+											((y * 255 / image.height) << 8) | (((x + y) * 255 / (image.width + image.height)));
+}
+
+void make_noise(corpus_image_t & image, Random & random)
+{
+	for(size_t i = 0; i < image.argb.size(); i++)
+		image.argb[i] = 0xff000000 | random.next();
+}
+
+//спрайты из прямоугольников и шахматного дизеринга цветами палитры из 48 цветов
+void make_palette_art(corpus_image_t & image, Random & random)
+{
+	uint32_t palette[48];
+	for(size_t i = 0; i < 48; i++)
+		palette[i] = 0xff000000 | random.next();
+	image.fill_rect(0, 0, image.width, image.height, palette[0]);
+	for(size_t i = 0; i < 400; i++)
+	{
+		const uint32_t x0 = random.next(image.width), y0 = random.next(image.height);
+		const uint32_t w = 4 + random.next(60), h = 4 + random.next(60);
+		const uint32_t a = palette[random.next(48)], b = palette[random.next(48)];
+		for(uint32_t y = y0; y < y0 + h && y < image.height; y++)
+			for(uint32_t x = x0; x < x0 + w && x < image.width; x++)
+				image.argb[y * image.width + x] = ((x ^ y) & 1) ? a : b;
+	}
+}
+
+//однотонный фон, окна с заголовками и строки "текста" из повторяющихся глифов 6x10
+void make_screenshot(corpus_image_t & image, Random & random)
+{
+	uint8_t glyphs[64][10];
+	for(size_t g = 0; g < 64; g++)
+		for(size_t r = 0; r < 10; r++)
+			glyphs[g][r] = random.next(64);
+	image.fill_rect(0, 0, image.width, image.height, 0xff2d5f8b);
+	for(size_t i = 0; i < 12; i++)
+	{
+		const uint32_t x0 = random.next(image.width * 3 / 4), y0 = random.next(image.height * 3 / 4);
+		const uint32_t w = 200 + random.next(400), h = 120 + random.next(300);
+		image.fill_rect(x0, y0, w, h, 0xfff0f0f0);
+		image.fill_rect(x0, y0, w, 20, 0xff3c3c78);
+		for(uint32_t line = y0 + 28; line + 10 < y0 + h; line += 14)
+			for(uint32_t x = x0 + 6; x + 6 < x0 + w - 6; x += 7)
+			{
+				const uint8_t * glyph = glyphs[random.next(64)];
+				for(uint32_t r = 0; r < 10 && line + r < image.height; r++)
+					for(uint32_t c = 0; c < 6 && x + c < image.width; c++)
+						if ((glyph[r] >> c) & 1)
+							image.argb[(line + r) * image.width + x + c] = 0xff101010;
+			}
+	}
+}
+
+class NullSink : public vp8l::VP8_LOSSLESS_ROW_SINK
+{
+public:
+	uint32_t	checksum;
+	NullSink()
+		: checksum(0)
+	{
+
+	}
+	void begin(const uint32_t & width, const uint32_t & height)
+	{
+
+	}
+	void row(const uint32_t & y, const uint32_t * argb)
+	{
+		checksum += argb[0];
+	}
+};
+
+struct bit_field_t
+{
+	uint32_t	bits;
+	uint32_t	count;
+};
+
+class Bench
+{
+private:
+	size_t		m_repetitions;
+	const corpus_image_t * m_image;
+	/*
+	 * measure
+	 * Бросает исключения: исключения body
+	 * Назначение:
+	 * вызывает body m_repetitions раз, возвращает отсортированные времена вызовов
+	 */
+	template<class Body>
+	void measure(Body body, std::vector<double> & times)
+	{
+		times.clear();
+		for(size_t i = 0; i < m_repetitions; i++)
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			body();
+			times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		std::sort(times.begin(), times.end());
+	}
+public:
+	Bench(const size_t & repetitions)
+		: m_repetitions(repetitions), m_image(NULL)
+	{
+
+	}
+	void image(const corpus_image_t & image)
+	{
+		m_image = &image;
+	}
+	/*
+	 * run
+	 * Бросает исключения: исключения body
+	 * Назначение:
+	 * печатает минимум и медиану времени body, MB/s по bytes - сколько байт обрабатывает один вызов, и ns на пиксель
+	 */
+	template<class Body>
+	void run(const std::string & stage, const size_t & bytes, Body body)
+	{
+		std::vector<double> times;
+		measure(body, times);
+		const double min = times[0], median = times[times.size() / 2];
+		printf("%-12s %-24s min %9.3f ms  median %9.3f ms  %9.1f MB/s  %8.2f ns/px\n", m_image->name.c_str(), stage.c_str(),
+				min * 1e3, median * 1e3, bytes / min / 1e6, min * 1e9 / m_image->argb.size());
+	}
+	/*
+	 * run_tables
+	 * Бросает исключения: исключения body
+	 * Назначение:
+	 * то же, что run, для стадий, время которых зависит от числа кодов Хаффмана, а не от размера изображения:
+	 * вместо MB/s печатается время на одну из tables таблиц
+	 */
+	template<class Body>
+	void run_tables(const std::string & stage, const size_t & tables, Body body)
+	{
+		std::vector<double> times;
+		measure(body, times);
+		const double min = times[0], median = times[times.size() / 2];
+		printf("%-12s %-24s min %9.3f ms  median %9.3f ms  %5u tables  %8.2f us/table\n", m_image->name.c_str(), stage.c_str(),
+				min * 1e3, median * 1e3, (uint32_t)tables, tables == 0 ? 0.0 : min * 1e6 / tables);
+	}
+};
+
+typedef lz77::LZ77<uint32_t> lz77_t;
+typedef vp8l::VP8_LOSSLESS_ENCODER::MetaHuffmanCodes meta_codes_t;
+
+//код символа, как его пишет VP8_LOSSLESS_ENCODER::WriteSymbol: единственный символ кода пишется за 0 бит
+bit_field_t symbol_field(const huffman_coding::enc::HuffmanTree & tree, const uint32_t & symbol)
+{
+	const bit_field_t field = { tree.get_codes()[symbol], tree.get_num_nodes() > 1 ? (uint32_t)tree.get_lengths()[symbol] : 0 };
+	return field;
+}
+
+/*
+ * huffman_fields
+ * Бросает исключения: нет
+ * Назначение:
+ * раскладывает токены в поля бит(коды Хаффмана мета кода тайла и экстра биты) в том порядке, в котором их пишет
+ * VP8_LOSSLESS_ENCODER::WriteLZ77CodedImage
+ */
+void huffman_fields(const lz77_t::token_stream & tokens, const meta_codes_t & codes, const size_t & xsize, std::vector<bit_field_t> & fields)
+{
+	fields.clear();
+	fields.reserve(tokens.size() * 4);
+	size_t x = 0, y = 0;
+	for(size_t i = 0; i < tokens.size(); i++)
+	{
+		const lz77_t::token & token = tokens[i];
+		const huffman_coding::enc::HuffmanTree * trees = codes.select(x, y);
+		if (token.is_literal())
+		{
+			const uint32_t argb = token.symbol();
+			const uint32_t symbols[4] = { (argb >> 8) & 0xff, (argb >> 16) & 0xff, argb & 0xff, argb >> 24 };
+			for(size_t c = 0; c < 4; c++)
+				fields.push_back(symbol_field(trees[c], symbols[c]));
+		}
+		else if (token.is_cache())
+			fields.push_back(symbol_field(trees[vp8l::huffman_io::GREEN], 256 + 24 + token.cache_key()));
+		else
+		{
+			uint32_t extra_bits_count, extra_bits;
+			fields.push_back(symbol_field(trees[vp8l::huffman_io::GREEN], 256 + token.length_symbol()));
+			lz77::prefix_coding_extra_bits(token.length(), token.length_symbol(), extra_bits_count, extra_bits);
+			const bit_field_t length_extra = { extra_bits, extra_bits_count };
+			fields.push_back(length_extra);
+			fields.push_back(symbol_field(trees[vp8l::huffman_io::DIST_PREFIX], token.dist_symbol()));
+			lz77::prefix_coding_extra_bits(token.dist_code(), token.dist_symbol(), extra_bits_count, extra_bits);
+			const bit_field_t dist_extra = { extra_bits, extra_bits_count };
+			fields.push_back(dist_extra);
+		}
+		x += token.pixels();
+		while(x >= xsize)
+		{
+			x -= xsize;
+			y++;
+		}
+	}
+}
+
+/*
+ * bench_inverse_transform
+ * Бросает исключения: InvalidVP8L
+ * Назначение:
+ * прогоняет обратную трансформацию по всему изображению пакетами строк, как это делает декодер
+ */
+void bench_inverse_transform(Bench & bench, const std::string & stage, vp8l::VP8_LOSSLESS_TRANSFORM & transform,
+								const corpus_image_t & image, const utils::pixel_array & in, const uint32_t & in_xsize)
+{
+	utils::pixel_array out(image.argb.size());
+	uint32_t batch_rows = INVERSE_TRANSFORM_BATCH_PIXELS / image.width;
+	if (batch_rows == 0)
+		batch_rows = 1;
+	bench.run(stage, image.argb.size() * 4, [&](){
+		for(uint32_t y = 0; y < image.height; y += batch_rows)
+		{
+			const uint32_t rows = image.height - y < batch_rows ? image.height - y : batch_rows;
+			transform.inverse_rows(&in[y * in_xsize], in_xsize, &out[y * image.width], image.width, y, rows, image.width);
+		}
+	});
+}
+
+void bench_image(Bench & bench, const corpus_image_t & image, const uint32_t & effort)
+{
+	bench.image(image);
+	const size_t pixel_bytes = image.argb.size() * 4;
+
+	//кодировщик
+	utils::byte_array webp_data;
+	bench.run("encode(total)", pixel_bytes, [&](){
+		WebP_ENCODER encoder(image.argb, image.width, image.height, effort, 1);
+		encoder.move_data(webp_data);
+	});
+
+	//стадии ниже получают то, что пакует кодировщик: изображение после трансформаций(для палитры - упакованные индексы),
+	//мета коды тайлов и токены со ссылками на цветовой кэш
+	vp8l::VP8_LOSSLESS_ENCODER encoder(effort, 1);
+	utils::pixel_array transformed(image.argb);
+	const size_t xsize = encoder.ApplyTransforms(image.width, image.height, transformed);
+
+	lz77_t * lz77 = NULL;
+	bench.run("LZ77::pack", transformed.size() * 4, [&](){
+		delete lz77;
+		lz77 = new lz77_t(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH, transformed, xsize, vp8l::LZ77ChainDepth[effort], &encoder.m_thread_pool);
+	});
+
+	meta_codes_t codes;
+	std::vector<vp8l::histogram::Histogram> clusters;
+	encoder.BuildEntropyCodes(*lz77, transformed, xsize, image.width, image.height, codes, clusters);
+	const size_t tables = clusters.size() * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE;
+	std::vector<histoarray> histos(tables);
+	for(size_t i = 0; i < clusters.size(); i++)
+		for(size_t j = 0; j < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; j++)
+			clusters[i].to_histoarray(j, histos[i * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE + j]);
+	codes.trees.realloc(tables);
+	huffman_coding::enc::HuffmanNodePool pool;
+	bench.run_tables("Huffman tree build", tables, [&](){
+		for(size_t i = 0; i < tables; i++)
+			codes.trees[i].build(histos[i], MAX_ENCODER_CODE_LENGTH, pool);
+	});
+
+	std::vector<bit_field_t> fields;
+	huffman_fields(lz77->output(), codes, xsize, fields);
+	delete lz77;
+	utils::BitWriter * bit_writer = NULL;
+	size_t stream_bytes = 0;
+	{
+		utils::BitWriter probe;
+		for(size_t i = 0; i < fields.size(); i++)
+			probe.WriteBits(fields[i].bits, fields[i].count);
+		stream_bytes = probe.size();
+	}
+	bench.run("BitWriter", stream_bytes, [&](){
+		delete bit_writer;
+		bit_writer = new utils::BitWriter();
+		for(size_t i = 0; i < fields.size(); i++)
+			bit_writer->WriteBits(fields[i].bits, fields[i].count);
+	});
+
+	//декодер
+	uint32_t checksum = 0;
+	bench.run("BitReader", stream_bytes, [&](){
+		utils::BitReader bit_reader(bit_writer->data(), bit_writer->size());
+		for(size_t i = 0; i < fields.size(); i++)
+			checksum += bit_reader.ReadBits(fields[i].count);
+	});
+	delete bit_writer;
+
+	//код из одного символа декодер таблицей не строит
+	std::vector<size_t> decoded_tables;
+	for(size_t i = 0; i < tables; i++)
+	{
+		size_t nonzero = 0;
+		for(size_t s = 0; s < codes.trees[i].get_lengths().size(); s++)
+			nonzero += codes.trees[i].get_lengths()[s] != 0;
+		if (nonzero > 1)
+			decoded_tables.push_back(i);
+	}
+	bench.run_tables("Huffman table build", decoded_tables.size(), [&](){
+		for(size_t i = 0; i < decoded_tables.size(); i++)
+			huffman_coding::dec::HuffmanTable table(codes.trees[decoded_tables[i]].get_lengths());
+	});
+
+	//ReadLZ77CodedImage закрыт и идет вперемешку с обратными трансформациями, поэтому замеряется декодирование
+	//целиком, а каждая обратная трансформация - отдельно ниже
+	NullSink sink;
+	bench.run("decode(total)", pixel_bytes, [&](){
+		WebP_DECODER decoder(&webp_data[0], webp_data.size(), sink);
+	});
+
+	Random random(image.width * 31 + image.height);
+	{
+		vp8l::VP8_LOSSLESS_TRANSFORM transform(vp8l::VP8_LOSSLESS_TRANSFORM::SUBTRACT_GREEN);
+		bench_inverse_transform(bench, "inverse subtract green", transform, image, image.argb, image.width);
+	}
+	{
+		vp8l::VP8_LOSSLESS_TRANSFORM transform(vp8l::VP8_LOSSLESS_TRANSFORM::PREDICTOR_TRANSFORM);
+		transform.init_data(DIV_ROUND_UP(image.width, 1 << PREDICTOR_BITS), DIV_ROUND_UP(image.height, 1 << PREDICTOR_BITS), PREDICTOR_BITS);
+		for(size_t i = 0; i < transform.data_length(); i++)
+			transform.data()[i] = random.next(PREDICTOR_MODES_COUNT) << 8;
+		bench_inverse_transform(bench, "inverse predictor", transform, image, image.argb, image.width);
+	}
+	{
+		vp8l::VP8_LOSSLESS_TRANSFORM transform(vp8l::VP8_LOSSLESS_TRANSFORM::COLOR_TRANSFORM);
+		transform.init_data(DIV_ROUND_UP(image.width, 1 << CROSS_COLOR_BITS), DIV_ROUND_UP(image.height, 1 << CROSS_COLOR_BITS), CROSS_COLOR_BITS);
+		for(size_t i = 0; i < transform.data_length(); i++)
+			transform.data()[i] = random.next();
+		bench_inverse_transform(bench, "inverse cross color", transform, image, image.argb, image.width);
+	}
+	{
+		//16 цветов, по 2 индекса в пикселе
+		vp8l::VP8_LOSSLESS_TRANSFORM transform(vp8l::VP8_LOSSLESS_TRANSFORM::COLOR_INDEXING_TRANSFORM);
+		transform.init_data(16, 1, 1);
+		for(size_t i = 0; i < transform.data_length(); i++)
+			transform.data()[i] = 0xff000000 | random.next();
+		const uint32_t packed_xsize = DIV_ROUND_UP(image.width, 2);
+		utils::pixel_array packed(packed_xsize * image.height);
+		for(size_t i = 0; i < packed.size(); i++)
+			packed[i] = 0xff000000 | (random.next(256) << 8);
+		bench_inverse_transform(bench, "inverse color indexing", transform, image, packed, packed_xsize);
+	}
+	g_checksum = checksum + sink.checksum;
+}
+
+/*
+ * verify_dsp
+ * Бросает исключения: исключения кодировщика и декодера
+ * Назначение:
+ * сверяет каждый поддерживаемый процессором SIMD уровень со скалярным: ядра по отдельности(dsp::verify) и кодирование
+ * корпуса целиком - поток должен совпасть байт в байт, а скалярный декодер должен восстановить исходные пиксели.
+ * Возвращает число расхождений, после сверки ядра снова выбираются по detect()
+ */
+size_t verify_dsp(const std::vector<corpus_image_t *> & corpus, const uint32_t & effort)
+{
+	static const char * levels[] = { "scalar", "SSE2", "AVX2" };
+	const vp8l::dsp::CPU_FEATURES detected = vp8l::dsp::detect();
+	size_t failures = vp8l::dsp::verify();
+
+	std::vector<utils::byte_array> reference(corpus.size());
+	for(int level = vp8l::dsp::CPU_SCALAR; level <= detected; level++)
+		for(size_t i = 0; i < corpus.size(); i++)
+		{
+			const corpus_image_t & image = *corpus[i];
+			vp8l::dsp::init((vp8l::dsp::CPU_FEATURES)level);
+			utils::byte_array webp_data;
+			{
+				WebP_ENCODER encoder(image.argb, image.width, image.height, effort, 1);
+				encoder.move_data(webp_data);
+			}
+			vp8l::dsp::init(vp8l::dsp::CPU_SCALAR);
+			utils::pixel_array argb;
+			vp8l::VP8_LOSSLESS_IMAGE_SINK sink(argb);
+			WebP_DECODER decoder(&webp_data[0], webp_data.size(), sink);
+			const bool decoded = argb.size() == image.argb.size() &&
+								memcmp(&argb[0], &image.argb[0], argb.size() * sizeof(uint32_t)) == 0;
+			const bool same_stream = level == vp8l::dsp::CPU_SCALAR ||
+								(webp_data.size() == reference[i].size() && memcmp(&webp_data[0], &reference[i][0], webp_data.size()) == 0);
+			if (level == vp8l::dsp::CPU_SCALAR)
+				reference[i].move_ref(webp_data);
+			if (!decoded || !same_stream)
+			{
+				failures++;
+				printf("dsp verify %s: %s %s\n", levels[level], image.name.c_str(),
+						!decoded ? "does not round-trip" : "encodes differently from scalar");
+			}
+		}
+	printf("dsp verify: corpus encoded at %d levels, %s\n", detected + 1, failures == 0 ? "OK" : "FAILED");
+	vp8l::dsp::init(detected);
+	return failures;
+}
+
+/*
+ * verify_stripes
+ * Бросает исключения: исключения кодировщика
+ * Назначение:
+ * проверяет, что полосы LZ77 не теряют дальних совпадений: нижняя половина шума повторяет верхнюю, поэтому
+ * изображение целиком в один и в два потока должно кодироваться не длиннее верхней половины плюс 1%.
+ * Возвращает число расхождений
+ */
+size_t verify_stripes(const uint32_t & effort)
+{
+	Random random(7);
+	corpus_image_t image("repeated rows", 2000, 700);
+	make_noise(image, random);
+	const size_t half = image.argb.size() / 2;
+	memcpy(&image.argb[half], &image.argb[0], half * sizeof(uint32_t));
+	utils::pixel_array top_half(half);
+	memcpy(&top_half[0], &image.argb[0], half * sizeof(uint32_t));
+
+	size_t failures = 0;
+	utils::byte_array webp_data;
+	{
+		WebP_ENCODER encoder(top_half, image.width, image.height / 2, effort, 1);
+		encoder.move_data(webp_data);
+	}
+	const size_t reference = webp_data.size();
+	for(size_t threads = 1; threads <= 2; threads++)
+	{
+		{
+			WebP_ENCODER encoder(image.argb, image.width, image.height, effort, threads);
+			encoder.move_data(webp_data);
+		}
+		const bool ok = webp_data.size() <= reference + reference / 100;
+		if (!ok)
+			failures++;
+		printf("stripes verify: %s %ux%u, %u threads %u bytes, top half %u bytes, %s\n", image.name.c_str(), image.width, image.height,
+				(uint32_t)threads, (uint32_t)webp_data.size(), (uint32_t)reference, ok ? "OK" : "FAILED");
+	}
+	return failures;
+}
+
+void print_help()
+{
+	std::cout << "WebP benchmark\n";
+	std::cout << "\t-h - this help\n";
+	std::cout << "\t-r repetitions - runs of every stage, min and median are reported(default 5)\n";
+	std::cout << "\t-z effort - encoder effort 0.." << ENCODER_MAX_EFFORT << "(default " << ENCODER_DEFAULT_EFFORT << ")\n";
+	std::cout << "\t-verify - check SSE2/AVX2 kernels against the scalar ones and LZ77 stripes against whole-image packing\n";
+	std::cout << "\t\tinstead of benchmarking, non-zero exit on mismatch\n";
+}
+
+int main(int argc, char * argv[])
+{
+	vp8l::huffman_io::init_array();
+	int repetitions = 5;
+	int effort = ENCODER_DEFAULT_EFFORT;
+	bool verify = false;
+	for(++argv; argv[0]; ++argv)
+	{
+		if (argv[0] == std::string("-verify"))
+			verify = true;
+		else
+		if (argv[0] == std::string("-r") && argv[1] != NULL)
+			repetitions = atoi((++argv)[0]);
+		else
+		if (argv[0] == std::string("-z") && argv[1] != NULL)
+			effort = atoi((++argv)[0]);
+		else
+		{
+			print_help();
+			return argv[0] == std::string("-h") ? 0 : 1;
+		}
+	}
+	if (repetitions < 1 || effort < 0 || effort > ENCODER_MAX_EFFORT)
+	{
+		print_help();
+		return 1;
+	}
+
+	Random random(1);
+	std::vector<corpus_image_t *> corpus;
+	corpus.push_back(new corpus_image_t("gradient", 1024, 768));
+	make_gradient(*corpus.back());
+	corpus.push_back(new corpus_image_t("noise", 512, 512));
+	make_noise(*corpus.back(), random);
+	corpus.push_back(new corpus_image_t("palette", 1024, 768));
+	make_palette_art(*corpus.back(), random);
+	corpus.push_back(new corpus_image_t("screenshot", 1280, 800));
+	make_screenshot(*corpus.back(), random);
+
+	static const char * levels[] = { "scalar", "SSE2", "AVX2" };
+	size_t failures = 0;
+	try
+	{
+		if (verify)
+			failures = verify_dsp(corpus, effort) + verify_stripes(effort);
+		else
+		{
+			printf("effort %d, %d repetitions, dsp %s\n", effort, repetitions, levels[vp8l::dsp::detect()]);
+			Bench bench(repetitions);
+			for(size_t i = 0; i < corpus.size(); i++)
+				bench_image(bench, *corpus[i], effort);
+		}
+	}
+	catch(exception::Exception & e)
+	{
+		std::cout << e.message << std::endl;
+		return 1;
+	}
+	for(size_t i = 0; i < corpus.size(); i++)
+		delete corpus[i];
+	return failures == 0 ? 0 : 1;
+}
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <fstream>
+#include <atomic>
+#include <mutex>
 #include "webp/webp.h"
 
 
@@ -13,6 +16,22 @@ struct image_t{
 	uint16_t height;
 };
 
+/*
+ * Все, что нужно для перекодирования одного файла: буфер пикселей PNG, кодировщик(пул потоков, BitWriter,
+ * цепочки хэшей и токены LZ77, гистограммы, деревья Хаффмана) и декодер(таблицы Хаффмана, буферы изображения).
+ * В пакетном режиме у каждого потока свой контекст, и память выделяется только под файлы крупнее прежних
+ */
+struct context_t{
+	image_t image;
+	webp::vp8l::VP8_LOSSLESS_ENCODER encoder;
+	webp::vp8l::VP8_LOSSLESS_DECODER decoder;
+	context_t(const int & effort, const int & threads)
+		: encoder(effort, threads)
+	{
+
+	}
+};
+
  int read_png(const std::string & file_name, image_t & image) {
   png_structp png;
   png_infop info;
@@ -110,9 +129,13 @@ struct image_t{
 		  }
 	  }
   free(rgb);
-  
+  ok = 1;
+
  End:
   fclose(fp);
+  //испорченный PNG - ошибка, а не пустое или прошлое изображение
+  if (!ok)
+	  throw webp::exception::PNGError();
   return ok;
 }
 
@@ -120,6 +143,137 @@ struct image_t{
 	 std::cout << "WebP Decoded/Encoder\n";
 	 std::cout << "\t-h - this help\n";
 	 std::cout << "\t-d|-e input_file_name output_file_name - decode|encode input file to output file\n";
+	 std::cout << "\t-z effort - compression effort 0.." << ENCODER_MAX_EFFORT << ", higher is slower and smaller(default " << ENCODER_DEFAULT_EFFORT << ")\n";
+	 std::cout << "\t-t threads - encoder worker threads, 0 - one per CPU core(default 0)\n";
+	 std::cout << "\t\tin batch mode jobs * threads is capped at the CPU core count, 0 - cores / jobs per file(default)\n";
+	 std::cout << "\t-b -d|-e manifest|input_dir output_dir - batch mode: decode|encode every file listed in manifest(one per line)\n";
+	 std::cout << "\t\tor every *.webp|*.png file of input_dir into output_dir\n";
+	 std::cout << "\t-j jobs - files transcoded concurrently in batch mode, at most one per CPU core, 0 - one per CPU core(default 0)\n";
+	 std::cout << "\t-v - print encoder progress\n";
+	 std::cout << "\t-s stats_file - write per-stage timings, stream part sizes and token counts as JSON, - for stdout(not in batch mode)\n";
+	 std::cout << "\t-verify - check SSE2/AVX2 kernels against the scalar ones, non-zero exit on mismatch\n";
+ }
+
+ void decode_file(const std::string & input, const std::string & output, context_t & context, webp::vp8l::Stats * stats = NULL){
+	//строки пишутся в PNG по мере декодирования
+	webp::PNG_ROW_WRITER png(output);
+	webp::WebP_DECODER webp(input, png, context.decoder, stats);
+ }
+
+ void encode_file(const std::string & input, const std::string & output, context_t & context, webp::vp8l::Stats * stats = NULL){
+	webp::vp8l::StageTimer timer(stats, "read png");
+	image_t & image = context.image;
+	//в пакетном режиме image остается от прошлого файла
+	image.width = image.height = 0;
+	read_png(input, image);
+	timer.stop();
+	webp::WebP_ENCODER encoder(context.encoder, image.image, image.width, image.height, output, stats);
+ }
+
+ /*
+  * save_stats
+  * Бросает исключения: FileOperationException
+  * Назначение:
+  * пишет статистику в JSON в файл file_name, "-" - в stdout
+  */
+ void save_stats(const webp::vp8l::Stats & stats, const std::string & file_name){
+	const std::string json = stats.json();
+	if (file_name == "-"){
+		fwrite(json.data(), 1, json.size(), stdout);
+		return;
+	}
+	FILE * fp = NULL;
+	#ifdef LINUX
+	  fp = fopen(file_name.c_str(), "wb");
+	#endif
+	#ifdef WINDOWS
+	  fopen_s(&fp, file_name.c_str(), "wb");
+	#endif
+	if (fp == NULL)
+		throw webp::exception::FileOperationException();
+	fwrite(json.data(), 1, json.size(), fp);
+	fclose(fp);
+ }
+
+ /*
+  * batch_output_name
+  * Бросает исключения: нет
+  * Назначение:
+  * имя выходного файла в output_dir: имя входного без каталога и расширения плюс extension
+  */
+ std::string batch_output_name(const std::string & input, const std::string & output_dir, const std::string & extension){
+	const size_t slash = input.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+	const size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot != 0)
+		name.erase(dot);
+	return output_dir + "/" + name + extension;
+ }
+
+ /*
+  * batch
+  * Бросает исключения: FileOperationException
+  * Назначение:
+  * перекодирует все файлы из манифеста(путь на строку, пустые строки и строки с # пропускаются) или каталога source
+  * в каталог output_dir на пуле из jobs потоков. У каждого потока свой context_t, который переиспользуется между файлами.
+  * Всего потоков не больше, чем ядер: jobs ограничено их числом, а кодировщику каждого файла достается не больше
+  * ядер / jobs потоков, threads <= 0 - ровно столько.
+  * Ошибка в одном файле, в том числе нехватка памяти, не останавливает остальные, возвращает кол-во файлов с ошибками
+  */
+ size_t batch(const bool & encode, const std::string & source, const std::string & output_dir, const int & effort,
+				const int & threads, const int & jobs){
+	std::vector<std::string> inputs;
+	if (webp::utils::is_directory(source))
+		webp::utils::list_directory(source, encode ? ".png" : ".webp", inputs);
+	else{
+		std::ifstream manifest(source.c_str());
+		if (!manifest)
+			throw webp::exception::FileOperationException();
+		std::string line;
+		while(std::getline(manifest, line)){
+			while(!line.empty() && (line[line.size() - 1] == '\r' || line[line.size() - 1] == ' '))
+				line.erase(line.size() - 1);
+			if (!line.empty() && line[0] != '#')
+				inputs.push_back(line);
+		}
+	}
+
+	const size_t cores = webp::utils::ThreadPool::hardware_threads();
+	size_t workers = jobs == 0 ? cores : jobs;
+	if (workers > cores){
+		printf("Jobs capped at %u CPU cores\n", (uint32_t)cores);
+		workers = cores;
+	}
+	size_t encoder_threads = cores / workers;
+	if (threads > 0 && (size_t)threads < encoder_threads)
+		encoder_threads = threads;
+	else if (encode && threads > 0 && (size_t)threads > encoder_threads)
+		printf("Threads per file capped at %u: jobs * threads may not exceed %u CPU cores\n", (uint32_t)encoder_threads, (uint32_t)cores);
+	webp::utils::ThreadPool pool(workers);
+	std::atomic<size_t> failed(0);
+	std::mutex log_mutex;
+	pool.parallel_for(inputs.size(), [&](size_t i){
+		thread_local context_t context(effort, encode ? encoder_threads : 1);
+		const std::string output = batch_output_name(inputs[i], output_dir, encode ? ".webp" : ".png");
+		try{
+			if (encode)
+				encode_file(inputs[i], output, context);
+			else
+				decode_file(inputs[i], output, context);
+		}
+		catch(webp::exception::Exception & e){
+			failed++;
+			std::lock_guard<std::mutex> lock(log_mutex);
+			std::cout << inputs[i] << ": " << e.message << std::endl;
+		}
+		catch(std::exception & e){
+			failed++;
+			std::lock_guard<std::mutex> lock(log_mutex);
+			std::cout << inputs[i] << ": " << e.what() << std::endl;
+		}
+	});
+	printf("Transcoded %u of %u files\n", (uint32_t)(inputs.size() - failed), (uint32_t)inputs.size());
+	return failed;
  }
 
 
@@ -130,6 +284,11 @@ int main(int argc, char * argv[])
 	std::string output;
 	bool encode = false;
 	bool decode = false;
+	bool batch_mode = false;
+	int effort = ENCODER_DEFAULT_EFFORT;
+	int threads = -1;
+	int jobs = 0;
+	std::string stats_file;
 	for(++argv; argv[0]; ++argv){
 		if (argv[0] == std::string("-d"))
 			decode = true;
@@ -137,10 +296,67 @@ int main(int argc, char * argv[])
 		if (argv[0] == std::string("-e"))
 			encode = true;
 		else
+		if (argv[0] == std::string("-z")){
+			if (argv[1] == NULL){
+				printf("Specify compression effort\n");
+				print_help();
+				return 1;
+			}
+			effort = atoi((++argv)[0]);
+			if (effort < 0 || effort > ENCODER_MAX_EFFORT){
+				printf("Compression effort must be in 0..%d\n", ENCODER_MAX_EFFORT);
+				return 1;
+			}
+		}
+		else
+		if (argv[0] == std::string("-t")){
+			if (argv[1] == NULL){
+				printf("Specify threads count\n");
+				print_help();
+				return 1;
+			}
+			threads = atoi((++argv)[0]);
+			if (threads < 0){
+				printf("Threads count must be >= 0\n");
+				return 1;
+			}
+		}
+		else
+		if (argv[0] == std::string("-b"))
+			batch_mode = true;
+		else
+		if (argv[0] == std::string("-j")){
+			if (argv[1] == NULL){
+				printf("Specify jobs count\n");
+				print_help();
+				return 1;
+			}
+			jobs = atoi((++argv)[0]);
+			if (jobs < 0){
+				printf("Jobs count must be >= 0\n");
+				return 1;
+			}
+		}
+		else
+		if (argv[0] == std::string("-v"))
+			webp::vp8l::Verbose() = true;
+		else
+		if (argv[0] == std::string("-s")){
+			if (argv[1] == NULL){
+				printf("Specify stats file name\n");
+				print_help();
+				return 1;
+			}
+			stats_file = (++argv)[0];
+		}
+		else
 		if (argv[0] == std::string("-h")){
 			print_help();
 			return 0;
 		}
+		else
+		if (argv[0] == std::string("-verify"))
+			return webp::vp8l::dsp::verify() == 0 ? 0 : 1;
 		else{
 			if (input.size() == 0)
 				input = argv[0];
@@ -169,22 +385,32 @@ int main(int argc, char * argv[])
 		print_help();
 		return 1;
 	}
+	if (batch_mode && stats_file.size() != 0){
+		printf("Stats are collected for a single file only\n");
+		return 1;
+	}
 
 	try{
-		if (decode){
-			webp::WebP_DECODER webp(input);
-			webp.save2png(output);
-			return 0;
-		}
-		if (encode){
-			image_t image;
-			read_png(input, image);
-			webp::WebP_ENCODER encoder(image.image, image.width, image.height, output);
-			return 0;
-		}
+		//в пакетном режиме параллельны прежде всего файлы, потоки внутри файла делят оставшиеся ядра
+		if (batch_mode)
+			return batch(encode, input, output, effort, threads, jobs) == 0 ? 0 : 1;
+		webp::vp8l::Stats stats;
+		webp::vp8l::Stats * stats_ptr = stats_file.size() == 0 ? NULL : &stats;
+		//декодеру потоки кодировщика не нужны
+		context_t context(effort, decode ? 1 : threads == -1 ? 0 : threads);
+		if (decode)
+			decode_file(input, output, context, stats_ptr);
+		if (encode)
+			encode_file(input, output, context, stats_ptr);
+		if (stats_ptr != NULL)
+			save_stats(stats, stats_file);
+		return 0;
 	}
 	catch(webp::exception::Exception & e){
 		std::cout << e.message << std::endl;
 	}
+	catch(std::exception & e){
+		std::cout << e.what() << std::endl;
+	}
 	return 0;
 }
@@ -54,5 +54,258 @@ int make_canonical_codes(const utils::array<code_length_t> & code_lengths,
 	return make_canonical_codes(&code_lengths[0], code_lengths.size(), huff_codes);
 }
 
+namespace enc
+{
+
+void package_merge(const uint64_t * const weights, const size_t & n, const size_t & max_length, code_length_t * const code_lengths)
+{
+	//levels[0] - список символов самой большой длины, levels[max_length - 1] - итоговый список.
+	//в каждом списке храним вес элемента и флаг, является ли он пакетом из двух элементов предыдущего списка
+	std::vector< std::vector<uint64_t> > level_weights(max_length);
+	std::vector< std::vector<bool> > level_packages(max_length);
+	level_weights[0].assign(weights, weights + n);
+	level_packages[0].assign(n, false);
+	for(size_t level = 1; level < max_length; level++)
+	{
+		const std::vector<uint64_t> & prev = level_weights[level - 1];
+		std::vector<uint64_t> & list = level_weights[level];
+		std::vector<bool> & packages = level_packages[level];
+		list.reserve(n + prev.size() / 2);
+		packages.reserve(n + prev.size() / 2);
+		size_t leaf = 0, package = 0;
+		const size_t packages_count = prev.size() / 2;
+		while(leaf < n || package < packages_count)
+		{
+			//при равенстве веса предпочитаем символ, это дает более короткие коды редким символам
+			if (package == packages_count || (leaf < n && weights[leaf] <= prev[2 * package] + prev[2 * package + 1]))
+			{
+				list.push_back(weights[leaf++]);
+				packages.push_back(false);
+			}
+			else
+			{
+				list.push_back(prev[2 * package] + prev[2 * package + 1]);
+				packages.push_back(true);
+				package++;
+			}
+		}
+	}
+	//из итогового списка берется 2n - 2 элемента, каждый символ среди них удлиняет свой код на 1,
+	//каждый пакет - это два элемента предыдущего списка
+	for(size_t i = 0; i < n; i++)
+		code_lengths[i] = 0;
+	size_t take = 2 * n - 2;
+	for(size_t level = max_length; level-- > 0 && take != 0;)
+	{
+		const std::vector<bool> & packages = level_packages[level];
+		size_t leaves = 0;
+		for(size_t i = 0; i < take; i++)
+			if (!packages[i])
+				leaves++;
+		//символы в списке идут в порядке возрастания веса, значит взяты первые leaves символов
+		for(size_t i = 0; i < leaves; i++)
+			code_lengths[i]++;
+		take = 2 * (take - leaves);
+	}
+}
+
+}
+
+namespace dec
+{
+
+static code_t reverse_code(code_t code, const code_length_t & length)
+{
+	code_t ret = 0;
+	for(code_length_t i = 0; i < length; i++)
+	{
+		ret = (ret << 1) | (code & 1);
+		code >>= 1;
+	}
+	return ret;
+}
+
+void HuffmanTable::explicit_init(const code_length_t * const code_lengths,
+						const code_t * const codes,
+						const symbol_t * const symbols,
+						symbol_t max_symbol,
+						size_t num_symbols)
+{
+	if (num_symbols == 0)
+		cnstr_error();
+	for (size_t i = 0; i < num_symbols; ++i)
+		if (codes[i] != NON_EXISTENT_SYMBOL && symbols[i] >= max_symbol)
+			cnstr_error();
+	if (num_symbols == 1)
+	{
+		build_single(symbols[0]);
+		return;
+	}
+	check_lengths(code_lengths, num_symbols);
+	build(code_lengths, codes, symbols, num_symbols);
+}
+
+void HuffmanTable::implicit_init(const code_length_t * const code_lengths,
+						const size_t & code_length_size)
+{
+	size_t num_symbols = 0;
+	symbol_t root_symbol = 0;
+	for (size_t symbol = 0; symbol < code_length_size; ++symbol)
+	{
+		if (code_lengths[symbol] > 0)
+		{
+			++num_symbols;
+			root_symbol = symbol;
+		}
+	}
+	if (num_symbols == 0)
+		cnstr_error();
+	//если символ только один, то он кодируется 0 битами
+	if (num_symbols == 1)
+	{
+		build_single(root_symbol);
+		return;
+	}
+	code_length_t max_code_length = check_lengths(code_lengths, code_length_size);
+	if (max_code_length > HUFFMAN_TABLE_MAX_CODE_LENGTH)
+	{
+		m_tree.push_back(HuffmanTree(code_lengths, code_length_size));
+		return;
+	}
+	utils::array<code_t> codes(code_length_size);
+	if (!make_canonical_codes(code_lengths, code_length_size, codes))
+		cnstr_error();
+	build(code_lengths, &codes[0], NULL, code_length_size);
+}
+
+/*
+ * check_lengths
+ * Бросает исключения: InvalidHuffman
+ * Назначение:
+ * проверяет, что длины кодов задают полный префиксный код(неравенство Крафта обращается в равенство),
+ * возвращает максимальную длину кода
+ */
+code_length_t HuffmanTable::check_lengths(const code_length_t * const code_lengths, const size_t & num_symbols)
+{
+	size_t code_length_hist[MAX_ALLOWED_CODE_LENGTH + 1] = { 0 };
+	code_length_t max_code_length = 0;
+	for (size_t i = 0; i < num_symbols; ++i)
+	{
+		if (code_lengths[i] > MAX_ALLOWED_CODE_LENGTH)
+			cnstr_error();
+		++code_length_hist[code_lengths[i]];
+		if (code_lengths[i] > max_code_length)
+			max_code_length = code_lengths[i];
+	}
+	size_t remaining = num_symbols - code_length_hist[0];
+	//кол-во свободных кодов на текущей длине
+	int64_t left = 1;
+	for (code_length_t len = 1; len <= max_code_length; ++len)
+	{
+		left = (left << 1) - code_length_hist[len];
+		remaining -= code_length_hist[len];
+		if (left < 0 || (size_t)left > remaining)
+			cnstr_error();
+	}
+	if (left != 0)
+		cnstr_error();
+	return max_code_length;
+}
+
+void HuffmanTable::build_single(const symbol_t & symbol)
+{
+	const size_t root_size = 1 << HUFFMAN_TABLE_ROOT_BITS;
+	if (m_entries.size() < root_size)
+		m_entries.realloc(root_size);
+	for (size_t i = 0; i < root_size; i++)
+	{
+		m_entries[i].value = symbol;
+		m_entries[i].bits = 0;
+	}
+}
+
+/*
+ * build
+ * Бросает исключения: нет
+ * Назначение:
+ * строит первичную и вторичные таблицы, codes - канонические коды(старший бит читается первым),
+ * если symbols == NULL, то символ равен индексу
+ */
+void HuffmanTable::build(const code_length_t * const code_lengths,
+						const code_t * const codes,
+						const symbol_t * const symbols,
+						const size_t & num_symbols)
+{
+	const size_t root_size = 1 << HUFFMAN_TABLE_ROOT_BITS;
+	const code_t root_mask = root_size - 1;
+	//биты поступают из потока младшими вперед, поэтому индексами таблиц служат развернутые коды
+	utils::array<code_t> reversed(num_symbols);
+	//размер вторичной таблицы в битах для каждого элемента первичной таблицы
+	uint8_t sub_bits[1 << HUFFMAN_TABLE_ROOT_BITS] = { 0 };
+	for (size_t i = 0; i < num_symbols; ++i)
+	{
+		if (code_lengths[i] == 0)
+			continue;
+		reversed[i] = reverse_code(codes[i], code_lengths[i]);
+		if (code_lengths[i] > HUFFMAN_TABLE_ROOT_BITS)
+		{
+			uint8_t bits = code_lengths[i] - HUFFMAN_TABLE_ROOT_BITS;
+			uint8_t & slot_bits = sub_bits[reversed[i] & root_mask];
+			if (bits > slot_bits)
+				slot_bits = bits;
+		}
+	}
+
+	size_t table_size = root_size;
+	for (size_t i = 0; i < root_size; ++i)
+		if (sub_bits[i] != 0)
+			table_size += (size_t)1 << sub_bits[i];
+	//при перестроении таблица только растет, см. init
+	if (m_entries.size() < table_size)
+		m_entries.realloc(table_size);
+	memset(&m_entries[0], 0, table_size * sizeof(HuffmanTableEntry));
+
+	size_t offset = root_size;
+	for (size_t i = 0; i < root_size; ++i)
+	{
+		if (sub_bits[i] == 0)
+			continue;
+		m_entries[i].value = offset;
+		m_entries[i].bits = HUFFMAN_TABLE_ROOT_BITS + sub_bits[i];
+		offset += (size_t)1 << sub_bits[i];
+	}
+
+	for (size_t i = 0; i < num_symbols; ++i)
+	{
+		const code_length_t len = code_lengths[i];
+		if (len == 0)
+			continue;
+		const symbol_t symbol = symbols == NULL ? i : symbols[i];
+		if (len <= HUFFMAN_TABLE_ROOT_BITS)
+		{
+			//код занимает все элементы первичной таблицы, у которых младшие len бит совпадают с кодом
+			for (size_t j = reversed[i]; j < root_size; j += (size_t)1 << len)
+			{
+				m_entries[j].value = symbol;
+				m_entries[j].bits = len;
+			}
+		}
+		else
+		{
+			const HuffmanTableEntry & link = m_entries[reversed[i] & root_mask];
+			const size_t sub_size = (size_t)1 << (link.bits - HUFFMAN_TABLE_ROOT_BITS);
+			const code_length_t sub_len = len - HUFFMAN_TABLE_ROOT_BITS;
+			HuffmanTableEntry * sub_table = &m_entries[link.value];
+			for (size_t j = reversed[i] >> HUFFMAN_TABLE_ROOT_BITS; j < sub_size; j += (size_t)1 << sub_len)
+			{
+				sub_table[j].value = symbol;
+				sub_table[j].bits = sub_len;
+			}
+		}
+	}
+}
+
+}
+
 }
 }
@@ -2,8 +2,10 @@
 #define HUFFMAN_H_
 
 #include <list>
+#include <algorithm>
 #include "../exception/exception.h"
 #include "../utils/utils.h"
+#include "../utils/bit_readed.h"
 
 namespace webp
 {
@@ -281,11 +283,142 @@ public:
 	}
 };
 
+/*
+ * Таблица для декодирования кодов Хаффмана.
+ * Первичная таблица индексируется следующими HUFFMAN_TABLE_ROOT_BITS битами потока. Если код длиннее, то элемент
+ * первичной таблицы ссылается на вторичную таблицу, которая индексируется оставшимися битами кода.
+ * Коды длиннее HUFFMAN_TABLE_MAX_CODE_LENGTH таблицей не декодируются, для них строится HuffmanTree
+ */
+#define HUFFMAN_TABLE_ROOT_BITS 8
+#define HUFFMAN_TABLE_MAX_CODE_LENGTH 20
+
+struct HuffmanTableEntry
+{
+	//символ, либо смещение вторичной таблицы, если bits > HUFFMAN_TABLE_ROOT_BITS в первичной таблице
+	uint32_t	value;
+	//длина кода(в первичной таблице) или оставшейся части кода(во вторичной), либо HUFFMAN_TABLE_ROOT_BITS + размер вторичной таблицы в битах
+	uint8_t		bits;
+};
+
+class HuffmanTable
+{
+private:
+	utils::array<HuffmanTableEntry>	m_entries;
+	//заполнено, только если коды слишком длинные для таблицы
+	std::vector<HuffmanTree>		m_tree;
+	void cnstr_error()
+	{
+		throw exception::InvalidHuffman();
+	}
+	void explicit_init(const code_length_t * const code_lengths,
+						const code_t * const codes,
+						const symbol_t * const symbols,
+						symbol_t max_symbol,
+						size_t num_symbols);
+	void implicit_init(const code_length_t * const code_lengths,
+						const size_t & code_length_size);
+	void build(const code_length_t * const code_lengths,
+				const code_t * const codes,
+				const symbol_t * const symbols,
+				const size_t & num_symbols);
+	void build_single(const symbol_t & symbol);
+	code_length_t check_lengths(const code_length_t * const code_lengths, const size_t & num_symbols);
+	symbol_t read_symbol_slow(utils::BitReader & br) const
+	{
+		HuffmanTree::iterator iter = m_tree[0].root();
+		while(!(*iter).is_leaf())
+			iter.next(br.ReadBits(1));
+		return (*iter).symbol();
+	}
+public:
+	//пустая таблица, строится вызовом init
+	HuffmanTable()
+	{
+
+	}
+	//явная инициализация таблицы, аналогично HuffmanTree
+	HuffmanTable(const code_length_t * const code_lengths,
+				const code_t * const codes,
+				const symbol_t * const symbols,
+				symbol_t max_symbol,
+				size_t num_symbols)
+	{
+		explicit_init(code_lengths, codes, symbols, max_symbol, num_symbols);
+	}
+	//неявная инициализация таблицы, задаются только длины кодов, и их кол-во
+	HuffmanTable(const utils::array<code_length_t> & code_lengths)
+	{
+		implicit_init(&code_lengths[0], code_lengths.size());
+	}
+	HuffmanTable(const code_length_t * const code_lengths,
+				const size_t & code_length_size)
+	{
+		implicit_init(code_lengths, code_length_size);
+	}
+	virtual ~HuffmanTable()
+	{
+
+	}
+	/*
+	 * init
+	 * Бросает исключения: InvalidHuffman
+	 * Назначение:
+	 * перестраивает таблицу под новые коды, аналогично конструкторам. Память таблицы только растет,
+	 * поэтому декодер, который читает много изображений, не выделяет ее заново
+	 */
+	void init(const code_length_t * const code_lengths,
+				const code_t * const codes,
+				const symbol_t * const symbols,
+				symbol_t max_symbol,
+				size_t num_symbols)
+	{
+		m_tree.clear();
+		explicit_init(code_lengths, codes, symbols, max_symbol, num_symbols);
+	}
+	void init(const utils::array<code_length_t> & code_lengths)
+	{
+		m_tree.clear();
+		implicit_init(&code_lengths[0], code_lengths.size());
+	}
+	/*
+	 * read_symbol
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * читает один символ из потока
+	 */
+	symbol_t read_symbol(utils::BitReader & br) const
+	{
+		if (!m_tree.empty())
+			return read_symbol_slow(br);
+		const HuffmanTableEntry * entry = &m_entries[br.PeekBits(HUFFMAN_TABLE_ROOT_BITS)];
+		if (entry->bits > HUFFMAN_TABLE_ROOT_BITS)
+		{
+			br.SkipBits(HUFFMAN_TABLE_ROOT_BITS);
+			entry = &m_entries[entry->value + br.PeekBits(entry->bits - HUFFMAN_TABLE_ROOT_BITS)];
+		}
+		br.SkipBits(entry->bits);
+		return entry->value;
+	}
+	size_t size() const
+	{
+		return m_entries.size();
+	}
+};
+
 }
 
 namespace enc
 {
 
+/*
+ * package_merge
+ * Бросает исключения: нет
+ * Назначение:
+ * вычисляет оптимальные длины кодов не длиннее max_length для n(2 <= n <= 2^max_length) символов,
+ * веса которых weights отсортированы по возрастанию
+ */
+void package_merge(const uint64_t * const weights, const size_t & n, const size_t & max_length, code_length_t * const code_lengths);
+
 class HuffmanTree;
 
 class HuffmanNode{
@@ -309,33 +442,58 @@ public:
 	friend class HuffmanTree;
 };
 
+/*
+ * Пул узлов для построения деревьев Хаффмана: узлы и рабочие очереди лежат в массивах, которые выделяются один раз
+ * и переиспользуются следующими деревьями. Узлы нужны только во время построения дерева, HuffmanTree их не хранит
+ */
+class HuffmanNodePool{
+private:
+	std::vector<HuffmanNode>	m_nodes;
+	size_t						m_used;
+	std::vector<HuffmanNode*>	m_leaves;
+	std::vector<HuffmanNode*>	m_merged;
+	HuffmanNodePool(const HuffmanNodePool &);
+	HuffmanNodePool & operator=(const HuffmanNodePool &);
+	/*
+	 * reset
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * освобождает все узлы пула и готовит его к дереву из num_leaves листьев, которому нужно не больше 2 * num_leaves - 1 узлов
+	 */
+	void reset(const size_t & num_leaves){
+		if (m_nodes.size() < 2 * num_leaves)
+			m_nodes.resize(2 * num_leaves);
+		m_used = 0;
+		m_leaves.clear();
+		m_merged.clear();
+	}
+	HuffmanNode * alloc(HuffmanNode* left0, HuffmanNode* right1, const uint64_t & p, const uint32_t & symbol = -1){
+		HuffmanNode * node = &m_nodes[m_used++];
+		*node = HuffmanNode(left0, right1, p, symbol);
+		return node;
+	}
+public:
+	HuffmanNodePool()
+		: m_used(0)
+	{
+
+	}
+	virtual ~HuffmanNodePool(){
+
+	}
+	friend class HuffmanTree;
+};
+
 class HuffmanTree{
 private:
-	utils::array<HuffmanNode*> m_roots;
 	utils::array<code_length_t> m_code_lengths;
 	utils::array<code_t> m_codes;
 	size_t						m_num_symbols;
-	std::list<HuffmanNode*>		m_all_nodes;
 	size_t						m_num_nodes;
-	static int sort_roots(const void * n1, const void * n2){
-		const HuffmanNode * n1_ = *(HuffmanNode**)n1;
-		const HuffmanNode * n2_ = *(HuffmanNode**)n2;
-
-		if (n1_ != NULL && n2_ == NULL )
-			return -1;
-		if (n1_ == NULL && n2_ == NULL)
-			return 0;
-		if (n1_ == NULL && n2_ != NULL)
-			return 1;
-
-		if (n1_->m_p < n2_->m_p)
-			return -1;
-		else if (n1_->m_p > n2_->m_p)
-			return 1;
-		return 0;
-	}
-	bool compare_nodes(const HuffmanNode & n1, const HuffmanNode & n2){
-		return n1.m_p < n2.m_p;
+	static bool less_nodes(const HuffmanNode * n1, const HuffmanNode * n2){
+		if (n1->m_p != n2->m_p)
+			return n1->m_p < n2->m_p;
+		return n1->m_symbol < n2->m_symbol;
 	}
 	void make_codes(const code_t & code, const code_length_t & code_length, HuffmanNode * iter){
 		if (iter->m_left0 != NULL)
@@ -348,11 +506,6 @@ private:
 			m_codes[symbol] = code;
 		}
 	}
-	void release(){
-		for(std::list<HuffmanNode*>::iterator iter = m_all_nodes.begin(); iter != m_all_nodes.end(); ++iter)
-			delete *iter;
-		m_all_nodes.clear();
-	}
 	void reverse_code(code_t & code, const code_length_t & length){
 		code_t ret = 0;
 		for(int i = length - 1; i >= 0; i--){
@@ -363,53 +516,67 @@ private:
 	}
 	HuffmanTree(const HuffmanTree & tree){}
 	HuffmanTree & operator=(const HuffmanTree & tree){return *this;}
-	void init(const histoarray & histo, const size_t & max_allowed_code_length){
+	/*
+	 * init
+	 * Бросает исключения: TooBigCodeLength, если символов больше, чем кодов длины max_allowed_code_length
+	 * Назначение:
+	 * строит коды Хаффмана двумя очередями: листья, отсортированные по частоте, и внутренние узлы, которые появляются
+	 * уже в порядке возрастания частоты. Если код получился длиннее max_allowed_code_length, длины кодов строятся заново
+	 * алгоритмом package-merge, который дает оптимальный код с ограниченной длиной
+	 */
+	void init(const histoarray & histo, const size_t & max_allowed_code_length, HuffmanNodePool & pool){
+		m_code_lengths.realloc(histo.size());
+		m_codes.realloc(histo.size());
 		m_code_lengths.fill(0);
 		m_codes.fill(0);
-		for(size_t i = 0; i < m_num_symbols; i++){
-			if (histo[i] == 0){
-				m_code_lengths[i] = 0;
-				m_codes[i] = 0;
-				m_roots[i] = NULL;
-				continue;
-			}
-			m_roots[i] = new HuffmanNode(NULL, NULL, histo[i], i);
-			m_num_nodes++;
-			m_all_nodes.push_back(m_roots[i]);
-		}
+		m_num_symbols = histo.size();
+		m_num_nodes = 0;
+		for(size_t i = 0; i < m_num_symbols; i++)
+			if (histo[i] != 0)
+				m_num_nodes++;
+		pool.reset(m_num_nodes);
+		std::vector<HuffmanNode*> & leaves = pool.m_leaves;
+		for(size_t i = 0; i < m_num_symbols; i++)
+			if (histo[i] != 0)
+				leaves.push_back(pool.alloc(NULL, NULL, histo[i], i));
 		if (m_num_nodes == 0)
 			return;
-		m_roots.sort(sort_roots);
-
-		HuffmanNode* n1 = m_roots[0];
-		HuffmanNode* n2 = m_roots[1];
-		while(n2 != NULL){
-			HuffmanNode * new_node = new HuffmanNode(n1, n2, n1->m_p + n2->m_p);
-			m_all_nodes.push_back(new_node);
-
-			m_roots[0] = new_node;
-			m_roots[1] = NULL;
-			m_roots.sort(sort_roots);
-			n1 = m_roots[0];
-			n2 = m_roots[1];
-
-		}
 		//если только один символ
-		if (m_roots[0]->m_left0 == NULL && m_roots[0]->m_right1 == NULL){
-			uint16_t symbol = m_roots[0]->m_symbol;
-			m_code_lengths[symbol] = 1;
-			m_codes[symbol] = 0;
+		if (m_num_nodes == 1){
+			m_code_lengths[leaves[0]->m_symbol] = 1;
+			return;
 		}
-		else
-			make_codes(0, 0, m_roots[0]);
+		if (max_allowed_code_length < sizeof(size_t) * 8 && m_num_nodes > ((size_t)1 << max_allowed_code_length))
+			throw exception::TooBigCodeLength(max_allowed_code_length, m_num_nodes);
+		std::sort(leaves.begin(), leaves.end(), less_nodes);
+
+		std::vector<HuffmanNode*> & merged = pool.m_merged;
+		merged.reserve(m_num_nodes - 1);
+		size_t next_leaf = 0, next_merged = 0;
+		for(size_t i = 0; i + 1 < m_num_nodes; i++){
+			HuffmanNode * n[2];
+			for(size_t k = 0; k < 2; k++){
+				if (next_leaf < leaves.size() && (next_merged == merged.size() || leaves[next_leaf]->m_p <= merged[next_merged]->m_p))
+					n[k] = leaves[next_leaf++];
+				else
+					n[k] = merged[next_merged++];
+			}
+			merged.push_back(pool.alloc(n[0], n[1], n[0]->m_p + n[1]->m_p));
+		}
+		make_codes(0, 0, merged.back());
 
 		size_t max_code_length = 0;
 		for(size_t i = 0; i < m_num_symbols; i++)
 			if (m_code_lengths[i] > max_code_length)
 				max_code_length = m_code_lengths[i];
 		if (max_code_length > max_allowed_code_length){
-			release();
-			throw exception::TooBigCodeLength(max_allowed_code_length, max_code_length);
+			std::vector<uint64_t> weights(m_num_nodes);
+			std::vector<code_length_t> lengths(m_num_nodes);
+			for(size_t i = 0; i < m_num_nodes; i++)
+				weights[i] = leaves[i]->m_p;
+			package_merge(&weights[0], m_num_nodes, max_allowed_code_length, &lengths[0]);
+			for(size_t i = 0; i < m_num_nodes; i++)
+				m_code_lengths[leaves[i]->m_symbol] = lengths[i];
 		}
 		make_canonical_codes(m_code_lengths, m_codes);
 		for(size_t i = 0; i < m_num_symbols; i++){
@@ -418,13 +585,30 @@ private:
 		}
 	}
 public:
-	HuffmanTree(){
+	HuffmanTree()
+		: m_num_symbols(0), m_num_nodes(0)
+	{
 
 	}
 	HuffmanTree(const histoarray & histo, const size_t & max_allowed_code_length)//, const uint32_t & size)
-		: m_roots(histo.size()), m_code_lengths(histo.size()), m_codes(histo.size()), m_num_symbols(histo.size()), m_num_nodes(0)
+		: m_num_symbols(0), m_num_nodes(0)
+	{
+		HuffmanNodePool pool;
+		init(histo, max_allowed_code_length, pool);
+	}
+	HuffmanTree(const histoarray & histo, const size_t & max_allowed_code_length, HuffmanNodePool & pool)
+		: m_num_symbols(0), m_num_nodes(0)
 	{
-		init(histo, max_allowed_code_length);
+		init(histo, max_allowed_code_length, pool);
+	}
+	/*
+	 * build
+	 * Бросает исключения: TooBigCodeLength
+	 * Назначение:
+	 * строит коды для дерева, созданного конструктором по умолчанию, например в массиве деревьев
+	 */
+	void build(const histoarray & histo, const size_t & max_allowed_code_length, HuffmanNodePool & pool){
+		init(histo, max_allowed_code_length, pool);
 	}
 	const utils::array<code_length_t> & get_lengths() const{
 		return m_code_lengths;
@@ -439,7 +623,6 @@ public:
 		return m_num_nodes;
 	}
 	virtual ~HuffmanTree(){
-		release();
 	}
 };
 
@@ -16,7 +16,6 @@ struct point
 	}
 };
 
-const uint32_t BORDER_DISTANCE_CODE = 120;
 const point dist_codes2dist[BORDER_DISTANCE_CODE] = {
 		point(0, 1), point(1, 0),  point(1, 1),  point(-1, 1), point(0, 2),  point(2, 0),  point(1, 2),  point(-1, 2),
 		point(2, 1),  point(-2, 1), point(2, 2),  point(-2, 2), point(0, 3),  point(3, 0),  point(1, 3),  point(-1, 3),
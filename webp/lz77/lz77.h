@@ -1,134 +1,609 @@
 #pragma once
 #include "../platform.h"
-#include <deque>
+#include <vector>
+#include <algorithm>
 #include "../utils/bit_writer.h"
+#include "../utils/thread_pool.h"
 
 
 namespace webp
 {
 namespace lz77
 {
-//			abab|abab
+
+//минимальная длина совпадения, короче выгоднее писать литералы
+#define LZ77_MIN_LENGTH 2
+//сколько позиций с тем же хэшем проверяется при поиске совпадения
+#define LZ77_DEFAULT_CHAIN_DEPTH 32
+#define LZ77_MAX_HASH_BITS 18
+//сколько ближайших по плоскости смещений проверяется до прохода по hash chain
+#define LZ77_PLANE_PROBES 12
+//размер горизонтальной полосы, упаковываемой независимо при нескольких потоках
+#define LZ77_STRIPE_PIXELS (1 << 18)
+//серии одинаковых символов и копии строки выше не короче этого пишутся сразу, без общего поиска совпадения
+#define LZ77_FAST_PATH_LENGTH 256
+//оптимальный разбор перебирает все длины совпадения не длиннее этой, у более длинных пробует только полную длину
+#define LZ77_OPTIMAL_MAX_LENGTHS 256
+//после совпадения не короче этого оптимальный разбор не ищет совпадения внутри него, чтобы не тонуть в однотонных областях
+#define LZ77_OPTIMAL_SKIP_LENGTH 256
+
+static const uint32_t BORDER_DISTANCE_CODE = 120;
+
+/*
+ * LZ77_prefix_coding_encode
+ * Бросает исключения: нет
+ * Назначение:
+ * длины совпадения и смещения LZ77 закодированы, эта функция декодирует их значения
+ */
+uint32_t prefix_coding_decode(const uint32_t & prefix_code, utils::BitReader & br);
+
+
+/*
+ * LZ77_distance_code2distance
+ * Бросает исключения: нет
+ * Назначение:
+ * коды длины совпадения LZ77 меньшие 120 закодированы, эта функция декодирует их значения
+ */
+uint32_t distance_code2distance(const uint32_t & xsize, const uint32_t & lz77_distance_code);
+
+void prefix_coding_encode(uint32_t distance, uint16_t & symbol,
+									 size_t & extra_bits_count,
+									 size_t & extra_bits_value);
+
+size_t distance2dist_code(const size_t & xsize, const size_t & dist);
+
+/*
+ * prefix_coding_extra_bits
+ * Бросает исключения: нет
+ * Назначение:
+ * по значению и его префиксному символу(см. prefix_coding_encode) вычисляет кол-во и значение экстра бит
+ */
+inline void prefix_coding_extra_bits(const uint32_t & value, const uint16_t & symbol,
+										uint32_t & extra_bits_count, uint32_t & extra_bits_value){
+	if (symbol < 4){
+		extra_bits_count = 0;
+		extra_bits_value = 0;
+		return;
+	}
+	extra_bits_count = (symbol - 2) >> 1;
+	const uint32_t offset = (2 + (symbol & 1)) << extra_bits_count;
+	extra_bits_value = value - 1 - offset;
+}
 
 template <class T>
 class LZ77{
 public:
-	struct token{
-		uint32_t	distance;
-		uint32_t	length;
-		T			symbol;
-		token(){}
-		token(const uint32_t & dist, const uint32_t & len, const T & s)
-			: distance(dist), length(len), symbol(s){}
+	/*
+	 * Токен упакован в 64 бита:
+	 * литерал - [0..31] символ;
+	 * копия - [0..20] код смещения, [21..26] префиксный символ кода смещения, [27..39] длина, [40..44] префиксный символ длины;
+	 * ссылка на цветовой кэш - [0..31] ключ кэша.
+	 * [62..63] тип токена.
+	 * Коды смещения и префиксные символы вычисляются один раз при упаковке.
+	 */
+	class token{
+	private:
+		uint64_t	m_value;
+		enum Kind{
+			LITERAL	= 0,
+			COPY	= 1,
+			CACHE	= 2
+		};
+		static const uint32_t KIND_SHIFT = 62;
+		token(const uint64_t & value)
+			: m_value(value){}
+	public:
+		token()
+			: m_value(0){}
+		static token literal(const T & symbol){
+			return token(((uint64_t)LITERAL << KIND_SHIFT) | (uint32_t)symbol);
+		}
+		static token cache(const uint32_t & key){
+			return token(((uint64_t)CACHE << KIND_SHIFT) | key);
+		}
+		static token copy(const uint32_t & length, const uint32_t & dist_code){
+			uint16_t length_symbol, dist_symbol;
+			size_t extra_bits_count, extra_bits_value;
+			prefix_coding_encode(length, length_symbol, extra_bits_count, extra_bits_value);
+			prefix_coding_encode(dist_code, dist_symbol, extra_bits_count, extra_bits_value);
+			return token(((uint64_t)COPY << KIND_SHIFT) | dist_code | ((uint64_t)dist_symbol << 21) |
+						((uint64_t)length << 27) | ((uint64_t)length_symbol << 40));
+		}
+		bool is_literal() const{
+			return (m_value >> KIND_SHIFT) == LITERAL;
+		}
+		bool is_copy() const{
+			return (m_value >> KIND_SHIFT) == COPY;
+		}
+		bool is_cache() const{
+			return (m_value >> KIND_SHIFT) == CACHE;
+		}
+		uint32_t cache_key() const{
+			return (uint32_t)m_value;
+		}
+		T symbol() const{
+			return (T)(uint32_t)m_value;
+		}
+		uint32_t dist_code() const{
+			return m_value & 0x1fffff;
+		}
+		uint16_t dist_symbol() const{
+			return (m_value >> 21) & 0x3f;
+		}
+		uint32_t length() const{
+			return (m_value >> 27) & 0x1fff;
+		}
+		uint16_t length_symbol() const{
+			return (m_value >> 40) & 0x1f;
+		}
+		//кол-во пикселей, которые покрывает токен
+		uint32_t pixels() const{
+			return is_copy() ? length() : 1;
+		}
 	};
+	typedef std::vector<token> token_stream;
 private:
-	std::deque<token>	m_output;
+	token_stream		m_output;
 	uint32_t			m_max_distance;
 	uint32_t			m_max_length;
-	void pack(const T* data, const uint32_t & size){
-		size_t i = 0;
-		uint32_t search_buffer_index = 0;
-		uint32_t la_buffer_index = 0;
-		uint32_t la_buffer_length = 0;
-		while(i != size || la_buffer_length != 0){
-			if (la_buffer_length < m_max_length && i != size)
-			{
-				uint32_t remain_in_buf = m_max_length - la_buffer_length;
-				uint32_t remain_in_data = size - i;
-				la_buffer_length += remain_in_buf > remain_in_data ? remain_in_data : remain_in_buf;
-				i += remain_in_buf > remain_in_data ? remain_in_data : remain_in_buf;
-			}
+	uint32_t			m_max_chain_depth;
+	//ширина изображения, 0 - данные одномерные
+	uint32_t			m_xsize;
+	//смещения для первых LZ77_PLANE_PROBES кодов смещения
+	std::vector<uint32_t>	m_plane_probes;
+	/*
+	 * hash chain по позициям из [base, end): m_head[hash] - последняя вставленная позиция с таким хэшем,
+	 * m_prev[i - base] - предыдущая позиция с тем же хэшем, что и i.
+	 * Массивы только растут, поэтому цепочка, переинициализированная reset, не выделяет память заново
+	 */
+	class hash_chain{
+	private:
+		utils::array<int32_t>	m_head;
+		utils::array<int32_t>	m_prev;
+		uint32_t				m_hash_bits;
+		uint32_t				m_base;
+		uint32_t hash(const T* data) const{
+			//хэш от пары соседних символов
+			const uint32_t key = ((uint32_t)data[0] * 0x1e35a7bdu) ^ ((uint32_t)data[1] * 0x9e3779b1u);
+			return key >> (32 - m_hash_bits);
+		}
+	public:
+		hash_chain()
+			: m_hash_bits(8), m_base(0)
+		{
 
-			if (la_buffer_length == 1){
-				T symbol = data[la_buffer_index++];
-				la_buffer_length--;
-				if (la_buffer_index -  search_buffer_index > m_max_distance)
-					search_buffer_index++;
-				m_output.push_back(token(0, 0, symbol));
+		}
+		void reset(const uint32_t & base, const uint32_t & end){
+			const uint32_t size = end - base;
+			m_base = base;
+			m_hash_bits = 8;
+			while(m_hash_bits < LZ77_MAX_HASH_BITS && (1u << m_hash_bits) < size)
+				m_hash_bits++;
+			if (m_head.size() < (1u << m_hash_bits))
+				m_head.realloc(1 << m_hash_bits);
+			memset(&m_head[0], -1, (1 << m_hash_bits) * sizeof(int32_t));
+			if (m_prev.size() < size || m_prev.size() == 0)
+				m_prev.realloc(size == 0 ? 1 : size);
+		}
+		void insert(const T* data, const uint32_t & end, const uint32_t & pos){
+			if (pos + 1 >= end)
+				return;
+			int32_t & head = m_head[hash(data + pos)];
+			m_prev[pos - m_base] = head;
+			head = pos;
+		}
+		int32_t first(const T* data, const uint32_t & pos) const{
+			return m_head[hash(data + pos)];
+		}
+		int32_t next(const int32_t & candidate) const{
+			return m_prev[candidate - m_base];
+		}
+	};
+	//hash chain и токены каждой полосы, см. pack_stripes
+	std::vector<hash_chain>		m_chains;
+	std::vector<token_stream>	m_stripes;
+	uint32_t match_length(const T* data, const uint32_t & pos, const uint32_t & distance, const uint32_t & max_length) const{
+		const T* cur = data + pos;
+		const T* ref = cur - distance;
+		uint32_t length = 0;
+		//сначала блоками по 16 байт, memcmp такой длины компилятор разворачивает в пару сравнений слов
+		const uint32_t block = 16 / sizeof(T) == 0 ? 1 : 16 / sizeof(T);
+		while(length + block <= max_length && memcmp(ref + length, cur + length, block * sizeof(T)) == 0)
+			length += block;
+		while(length < max_length && ref[length] == cur[length])
+			length++;
+		return length;
+	}
+	size_t dist_code(const uint32_t & distance) const{
+		if (m_xsize == 0)
+			return distance + BORDER_DISTANCE_CODE;
+		return distance2dist_code(m_xsize, distance);
+	}
+	/*
+	 * find_match
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * сначала проверяет ближайшие по плоскости смещения(они кодируются коротко), затем проходит по hash chain
+	 * не дальше m_max_chain_depth позиций. Совпадение не выходит за end.
+	 * Возвращает длину самого длинного совпадения, при равной длине предпочитается смещение с меньшим кодом
+	 */
+	uint32_t find_match(const T* data, const uint32_t & end, const uint32_t & pos, const hash_chain & chain, uint32_t & distance) const{
+		uint32_t best_length = 0;
+		size_t best_dist_code = 0;
+		if (pos + 1 >= end)
+			return 0;
+		const uint32_t max_length = end - pos < m_max_length ? end - pos : m_max_length;
+		const T* cur = data + pos;
+		for(size_t i = 0; i < m_plane_probes.size(); i++){
+			const uint32_t probe = m_plane_probes[i];
+			if (probe > pos || probe > m_max_distance)
+				continue;
+			if ((cur - probe)[best_length] != cur[best_length])
 				continue;
+			const uint32_t length = match_length(data, pos, probe, max_length);
+			if (length > best_length){
+				best_length = length;
+				best_dist_code = i + 1;
+				distance = probe;
+				if (length == max_length)
+					return best_length;
 			}
-
-			token temp_token;
-			temp_token.length = 0;
-			bool match = false;
-			const T* sb_stop = data + la_buffer_index;
-			const T* la_stop = data + la_buffer_index + la_buffer_length;
-			for(int j = la_buffer_index - 1; j >= (int)search_buffer_index; j--){
-				const T* search_buffer_iter = &data[j];
-				const T* la_buffer_iter = &data[la_buffer_index];
-				uint32_t length = 0;
-				uint32_t distance = la_buffer_index - j;
-				while(length <= m_max_length && search_buffer_iter != sb_stop && la_buffer_iter != la_stop){
-					if (*search_buffer_iter++ == *la_buffer_iter++)
-						length++;
-					else
-						break;
-				}
-				if (length){
-					if (length >= temp_token.length)
-						temp_token = token(distance, length, data[length + la_buffer_index]);
-					match = true;
-				}
+		}
+		int32_t candidate = chain.first(data, pos);
+		for(uint32_t depth = 0; depth < m_max_chain_depth && candidate >= 0; depth++, candidate = chain.next(candidate)){
+			const uint32_t candidate_distance = pos - candidate;
+			if (candidate_distance > m_max_distance)
+				break;
+			//совпадение короче уже найденного не интересно
+			if (data[candidate + best_length] != cur[best_length])
+				continue;
+			const uint32_t length = match_length(data, pos, candidate_distance, max_length);
+			if (length < best_length)
+				continue;
+			const size_t code = dist_code(candidate_distance);
+			if (length > best_length || code < best_dist_code){
+				best_length = length;
+				best_dist_code = code;
+				distance = candidate_distance;
+				if (length == max_length)
+					break;
 			}
-			if (match){
-				m_output.push_back(temp_token);
-
-				la_buffer_index += temp_token.length ;
-				la_buffer_length -= temp_token.length;
-				if (la_buffer_length > m_max_length)
-					la_buffer_length = 0;
-				if (la_buffer_index - search_buffer_index > m_max_distance){
-					search_buffer_index = la_buffer_index - m_max_distance;
-				}
+		}
+		return best_length;
+	}
+	/*
+	 * find_fast_match
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * проверяет только серию одинаковых символов(смещение 1) и копию строки выше(смещение m_xsize, код 1).
+	 * Возвращает длину более длинной из них, при равной длине предпочитается строка выше, у нее код короче
+	 */
+	uint32_t find_fast_match(const T* data, const uint32_t & end, const uint32_t & pos, uint32_t & distance) const{
+		if (pos == 0 || pos + 1 >= end)
+			return 0;
+		const uint32_t max_length = end - pos < m_max_length ? end - pos : m_max_length;
+		uint32_t best_length = 0;
+		if (m_xsize != 0 && m_xsize <= pos && m_xsize <= m_max_distance){
+			best_length = match_length(data, pos, m_xsize, max_length);
+			distance = m_xsize;
+		}
+		if (best_length < max_length && data[pos] == data[pos - 1]){
+			const uint32_t length = match_length(data, pos, 1, max_length);
+			if (length > best_length){
+				best_length = length;
+				distance = 1;
+			}
+		}
+		return best_length;
+	}
+	void init_plane_probes(){
+		m_plane_probes.clear();
+		if (m_xsize == 0)
+			return;
+		for(uint32_t code = 1; code <= LZ77_PLANE_PROBES; code++)
+			m_plane_probes.push_back(distance_code2distance(m_xsize, code));
+	}
+	/*
+	 * pack_range
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * упаковывает символы из [begin, end) в tokens. Совпадения могут ссылаться на символы до begin,
+	 * для этого в hash chain предварительно вставляются все позиции окна m_max_distance перед begin
+	 */
+	void pack_range(const T* data, const uint32_t & begin, const uint32_t & end, hash_chain & chain, token_stream & tokens) const{
+		//токенов не больше, чем символов
+		tokens.reserve(end - begin);
+		if (m_max_chain_depth == 0){
+			for(uint32_t i = begin; i < end; i++)
+				tokens.push_back(token::literal(data[i]));
+			return;
+		}
+		const uint32_t warmup = begin < m_max_distance ? begin : m_max_distance;
+		chain.reset(begin - warmup, end);
+		for(uint32_t i = begin - warmup; i < begin; i++)
+			chain.insert(data, end, i);
+		uint32_t i = begin;
+		while(i < end){
+			uint32_t distance = 0;
+			//однотонные области и повторяющиеся строки находятся без прохода по hash chain
+			uint32_t length = find_fast_match(data, end, i, distance);
+			const bool fast = length >= LZ77_FAST_PATH_LENGTH;
+			if (!fast)
+				length = find_match(data, end, i, chain, distance);
+			if (length >= LZ77_MIN_LENGTH){
+				tokens.push_back(token::copy(length, dist_code(distance)));
+				//из длинной серии или копии строки выше в hash chain идет только хвост, середина лишь удлиняет
+				//цепочки одинаковыми кандидатами, а ссылки на нее находят пробы по плоскости
+				uint32_t j = fast && length > LZ77_FAST_PATH_LENGTH ? length - LZ77_FAST_PATH_LENGTH : 0;
+				for(; j < length; j++)
+					chain.insert(data, end, i + j);
+				i += length;
 			}
 			else{
-				T symbol = data[la_buffer_index++];
-				la_buffer_length--;
-				if (la_buffer_index -  search_buffer_index > m_max_distance)
-					search_buffer_index++;
-				m_output.push_back(token(0, 0, symbol));
+				tokens.push_back(token::literal(data[i]));
+				chain.insert(data, end, i);
+				i++;
+			}
+		}
+	}
+	/*
+	 * optimal_match
+	 * Кандидат оптимального разбора: смещение и длина совпадения со стоимостью смещения в битах
+	 */
+	struct optimal_match{
+		uint32_t	length;
+		uint32_t	dist_code;
+		float		cost;
+	};
+	/*
+	 * add_optimal_match
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * оставляет в matches только кандидатов, для которых нет одновременно не более короткого и не более дорогого
+	 */
+	static void add_optimal_match(std::vector<optimal_match> & matches, const optimal_match & match){
+		for(size_t i = 0; i < matches.size(); i++)
+			if (matches[i].length >= match.length && matches[i].cost <= match.cost)
+				return;
+		size_t count = 0;
+		for(size_t i = 0; i < matches.size(); i++)
+			if (matches[i].length > match.length || matches[i].cost < match.cost)
+				matches[count++] = matches[i];
+		matches.resize(count);
+		matches.push_back(match);
+	}
+	/*
+	 * find_optimal_matches
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * собирает в matches(по возрастанию длины и стоимости) совпадения, выгодные по длине или по стоимости смещения.
+	 * Смещения из hash chain идут по возрастанию, а с ним растет и код, поэтому из них берутся только более длинные
+	 */
+	template<class CostModel>
+	void find_optimal_matches(const T* data, const uint32_t & end, const uint32_t & pos, const hash_chain & chain,
+								const CostModel & model, std::vector<optimal_match> & matches) const{
+		matches.clear();
+		if (pos + 1 >= end)
+			return;
+		const uint32_t max_length = end - pos < m_max_length ? end - pos : m_max_length;
+		const T* cur = data + pos;
+		uint32_t best_length = 0;
+		for(size_t i = 0; i < m_plane_probes.size(); i++){
+			const uint32_t probe = m_plane_probes[i];
+			if (probe > pos || probe > m_max_distance)
 				continue;
+			const uint32_t length = match_length(data, pos, probe, max_length);
+			if (length < LZ77_MIN_LENGTH)
+				continue;
+			const optimal_match match = { length, (uint32_t)(i + 1), model.distance(i + 1) };
+			add_optimal_match(matches, match);
+			if (length > best_length)
+				best_length = length;
+		}
+		int32_t candidate = chain.first(data, pos);
+		for(uint32_t depth = 0; depth < m_max_chain_depth && candidate >= 0 && best_length < max_length;
+				depth++, candidate = chain.next(candidate)){
+			const uint32_t candidate_distance = pos - candidate;
+			if (candidate_distance > m_max_distance)
+				break;
+			if (data[candidate + best_length] != cur[best_length])
+				continue;
+			const uint32_t length = match_length(data, pos, candidate_distance, max_length);
+			if (length <= best_length || length < LZ77_MIN_LENGTH)
+				continue;
+			const uint32_t code = dist_code(candidate_distance);
+			const optimal_match match = { length, code, model.distance(code) };
+			add_optimal_match(matches, match);
+			best_length = length;
+		}
+		std::sort(matches.begin(), matches.end(), [](const optimal_match & a, const optimal_match & b){
+			return a.length < b.length;
+		});
+	}
+	/*
+	 * optimal_range
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * упаковывает символы из [begin, end) в tokens с наименьшей по model суммарной стоимостью.
+	 * cost[k] - наименьшая стоимость первых k символов, из каждой позиции стоимость продлевается литералом и
+	 * совпадениями всех длин до LZ77_OPTIMAL_MAX_LENGTHS, затем путь восстанавливается с конца.
+	 * model.literal(pos) - стоимость литерала(или ссылки на кэш) в позиции pos, model.length(length) и
+	 * model.distance(dist_code) - стоимость длины и кода смещения копии вместе с экстра битами
+	 */
+	template<class CostModel>
+	void optimal_range(const T* data, const uint32_t & begin, const uint32_t & end, const CostModel & model,
+						hash_chain & chain, token_stream & tokens) const{
+		if (m_max_chain_depth == 0){
+			pack_range(data, begin, end, chain, tokens);
+			return;
+		}
+		const uint32_t size = end - begin;
+		//стоимости копятся в double, у float на длинной полосе не хватает точности на дробные биты
+		std::vector<double> cost(size + 1, 1e300);
+		//длина последнего токена на пути в k, 1 - литерал
+		std::vector<uint16_t> from_length(size + 1, 0);
+		std::vector<uint32_t> from_dist_code(size + 1, 0);
+		cost[0] = 0;
+
+		const uint32_t warmup = begin < m_max_distance ? begin : m_max_distance;
+		chain.reset(begin - warmup, end);
+		for(uint32_t i = begin - warmup; i < begin; i++)
+			chain.insert(data, end, i);
+		std::vector<optimal_match> matches;
+		uint32_t skip_until = begin;
+		for(uint32_t i = begin; i < end; i++){
+			const uint32_t k = i - begin;
+			const double literal_cost = cost[k] + model.literal(i);
+			if (literal_cost < cost[k + 1]){
+				cost[k + 1] = literal_cost;
+				from_length[k + 1] = 1;
 			}
+			if (i >= skip_until){
+				find_optimal_matches(data, end, i, chain, model, matches);
+				if (!matches.empty()){
+					const uint32_t max_length = matches.back().length;
+					const uint32_t lengths_end = max_length < LZ77_OPTIMAL_MAX_LENGTHS ? max_length : LZ77_OPTIMAL_MAX_LENGTHS;
+					size_t m = 0;
+					for(uint32_t length = LZ77_MIN_LENGTH; length <= lengths_end; length++){
+						while(matches[m].length < length)
+							m++;
+						const double copy_cost = cost[k] + model.length(length) + matches[m].cost;
+						if (copy_cost < cost[k + length]){
+							cost[k + length] = copy_cost;
+							from_length[k + length] = length;
+							from_dist_code[k + length] = matches[m].dist_code;
+						}
+					}
+					for(; m < matches.size(); m++){
+						const uint32_t length = matches[m].length;
+						if (length <= lengths_end)
+							continue;
+						const double copy_cost = cost[k] + model.length(length) + matches[m].cost;
+						if (copy_cost < cost[k + length]){
+							cost[k + length] = copy_cost;
+							from_length[k + length] = length;
+							from_dist_code[k + length] = matches[m].dist_code;
+						}
+					}
+					if (max_length >= LZ77_OPTIMAL_SKIP_LENGTH)
+						skip_until = i + max_length;
+				}
+			}
+			chain.insert(data, end, i);
+		}
+
+		token_stream path;
+		for(uint32_t k = size; k > 0; k -= from_length[k]){
+			if (from_length[k] == 1)
+				path.push_back(token::literal(data[begin + k - 1]));
+			else
+				path.push_back(token::copy(from_length[k], from_dist_code[k]));
 		}
+		tokens.reserve(path.size());
+		tokens.insert(tokens.end(), path.rbegin(), path.rend());
+	}
+	/*
+	 * pack_stripes
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * если в пуле больше одного потока, большие изображения делятся на горизонтальные полосы по LZ77_STRIPE_PIXELS
+	 * символов, полосы упаковываются pack_stripe параллельно и склеиваются в m_output. Каждая полоса видит все окно
+	 * перед собой, но серии и совпадения рвутся на границах полос, поэтому в один поток изображение упаковывается целиком.
+	 * Разбиение не зависит от кол-ва потоков больше одного, поэтому результат тоже.
+	 * У каждой полосы своя hash chain из m_chains, они и потоки токенов полос остаются для следующей упаковки
+	 */
+	void pack_stripes(const uint32_t & size, utils::ThreadPool * pool,
+						const std::function<void(uint32_t, uint32_t, hash_chain &, token_stream &)> & pack_stripe){
+		m_output.clear();
+		if (m_xsize == 0 || size <= LZ77_STRIPE_PIXELS || pool == NULL || pool->size() == 1){
+			if (m_chains.empty())
+				m_chains.resize(1);
+			pack_stripe(0, size, m_chains[0], m_output);
+			return;
+		}
+		uint32_t stripe_rows = LZ77_STRIPE_PIXELS / m_xsize;
+		if (stripe_rows == 0)
+			stripe_rows = 1;
+		const uint32_t stripe_size = stripe_rows * m_xsize;
+		const size_t stripes_count = (size + stripe_size - 1) / stripe_size;
+		if (m_chains.size() < stripes_count)
+			m_chains.resize(stripes_count);
+		if (m_stripes.size() < stripes_count)
+			m_stripes.resize(stripes_count);
+		std::function<void(size_t)> pack_stripe_i = [&](size_t i){
+			const uint32_t begin = i * stripe_size;
+			const uint32_t end = size - begin < stripe_size ? size : begin + stripe_size;
+			m_stripes[i].clear();
+			pack_stripe(begin, end, m_chains[i], m_stripes[i]);
+		};
+		pool->parallel_for(stripes_count, pack_stripe_i);
+		size_t tokens_count = 0;
+		for(size_t i = 0; i < stripes_count; i++)
+			tokens_count += m_stripes[i].size();
+		m_output.reserve(tokens_count);
+		for(size_t i = 0; i < stripes_count; i++)
+			m_output.insert(m_output.end(), m_stripes[i].begin(), m_stripes[i].end());
+	}
+	void pack(const T* data, const uint32_t & size, utils::ThreadPool * pool){
+		init_plane_probes();
+		pack_stripes(size, pool, [&](uint32_t begin, uint32_t end, hash_chain & chain, token_stream & tokens){
+			pack_range(data, begin, end, chain, tokens);
+		});
 	}
 public:
-	LZ77(const uint32_t & max_distance, const uint32_t & max_length, const utils::array<T> & data)
-		: m_max_distance(max_distance), m_max_length(max_length)
+	/*
+	 * Упаковщик без данных, данные передаются в pack. Так hash chain и потоки токенов переиспользуются между упаковками
+	 */
+	LZ77(const uint32_t & max_distance, const uint32_t & max_length)
+		: m_max_distance(max_distance), m_max_length(max_length), m_max_chain_depth(LZ77_DEFAULT_CHAIN_DEPTH), m_xsize(0)
 	{
-		pack(&data[0], data.size());
+
+	}
+	LZ77(const uint32_t & max_distance, const uint32_t & max_length, const utils::array<T> & data,
+			const uint32_t & xsize = 0, const uint32_t & max_chain_depth = LZ77_DEFAULT_CHAIN_DEPTH,
+			utils::ThreadPool * pool = NULL)
+		: m_max_distance(max_distance), m_max_length(max_length), m_max_chain_depth(max_chain_depth), m_xsize(xsize)
+	{
+		pack(&data[0], data.size(), pool);
 	}
-	LZ77(const uint32_t & max_distance, const uint32_t & max_length, const T * data, const uint32_t & size)
-		: m_max_distance(max_distance), m_max_length(max_length)
+	LZ77(const uint32_t & max_distance, const uint32_t & max_length, const T * data, const uint32_t & size,
+			const uint32_t & xsize = 0, const uint32_t & max_chain_depth = LZ77_DEFAULT_CHAIN_DEPTH,
+			utils::ThreadPool * pool = NULL)
+		: m_max_distance(max_distance), m_max_length(max_length), m_max_chain_depth(max_chain_depth), m_xsize(xsize)
 	{
-		pack(data, size);
+		pack(data, size, pool);
+	}
+	/*
+	 * optimize
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * заново упаковывает те же данные оптимальным разбором по стоимостям model(см. optimal_range),
+	 * обычно построенным по гистограммам жадного разбора
+	 */
+	template<class CostModel>
+	void optimize(const utils::array<T> & data, const CostModel & model, utils::ThreadPool * pool = NULL){
+		pack_stripes(data.size(), pool, [&](uint32_t begin, uint32_t end, hash_chain & chain, token_stream & tokens){
+			optimal_range(&data[0], begin, end, model, chain, tokens);
+		});
 	}
-	const std::deque<token> & output() const{
+	/*
+	 * pack
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * упаковывает data шириной xsize заново, память прошлой упаковки переиспользуется
+	 */
+	void pack(const utils::array<T> & data, const uint32_t & xsize, const uint32_t & max_chain_depth, utils::ThreadPool * pool = NULL){
+		m_xsize = xsize;
+		m_max_chain_depth = max_chain_depth;
+		pack(&data[0], data.size(), pool);
+	}
+	const token_stream & output() const{
+		return m_output;
+	}
+	token_stream & output(){
 		return m_output;
 	}
 };
 
-/*
- * LZ77_prefix_coding_encode
- * Бросает исключения: нет
- * Назначение:
- * длины совпадения и смещения LZ77 закодированы, эта функция декодирует их значения
- */
-uint32_t prefix_coding_decode(const uint32_t & prefix_code, utils::BitReader & br);
-
-
-/*
- * LZ77_distance_code2distance
- * Бросает исключения: нет
- * Назначение:
- * коды длины совпадения LZ77 меньшие 120 закодированы, эта функция декодирует их значения
- */
-uint32_t distance_code2distance(const uint32_t & xsize, const uint32_t & lz77_distance_code);
-
-void prefix_coding_encode(uint32_t distance, uint16_t & symbol,
-									 size_t & extra_bits_count,
-									 size_t & extra_bits_value);
-
-size_t distance2dist_code(const size_t & xsize, const size_t & dist);
-
 }
 }
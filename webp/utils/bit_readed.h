@@ -7,12 +7,23 @@ namespace webp
 namespace utils
 {
 
+/*
+ * Биты читаются младшими вперед. Читатель держит окно из 64 бит, которое пополняется целыми байтами
+ * (невыровненной загрузкой 8 байт, если до конца потока их хватает), поэтому за один вызов можно
+ * прочитать/посмотреть до 32 бит.
+ * Чтение за концом потока возвращает нули и выставляет флаг ошибки.
+ */
 class BitReader
 {
 private:
-	const uint8_t* const			m_data;
-	uint64_t				m_bits_readed;
-	size_t							m_length;
+	const uint8_t*			m_data;
+	size_t					m_length;
+	//индекс следующего байта, который будет загружен в окно
+	size_t					m_pos;
+	//окно, младший бит - следующий бит потока
+	uint64_t				m_value;
+	//кол-во достоверных бит в окне
+	uint32_t				m_bits;
 	bool					m_eos;
 	bool					m_error;
 	BitReader & operator=(const BitReader&)
@@ -24,52 +35,119 @@ private:
 	{
 
 	}
-	uint32_t ReadBit()
+	void Fill()
 	{
-		if (m_eos)
+		if (m_pos + sizeof(uint64_t) <= m_length)
 		{
-			m_error = true;
-			return 0;
+			uint64_t bytes;
+			memcpy(&bytes, m_data + m_pos, sizeof(uint64_t));
+			//загружаем столько целых байт, сколько влезает в окно.
+			//Старшие биты окна могут получить часть следующего байта, при следующей загрузке он ляжет на то же место
+			const uint32_t bytes_loaded = (64 - m_bits) >> 3;
+			m_value |= bytes << m_bits;
+			m_pos += bytes_loaded;
+			m_bits += bytes_loaded << 3;
+		}
+		else
+		{
+			while(m_bits <= 56 && m_pos < m_length)
+			{
+				m_value |= (uint64_t)m_data[m_pos++] << m_bits;
+				m_bits += 8;
+			}
 		}
-		uint64_t byte_index = m_bits_readed / 8;
-		char byte = m_data[byte_index];
-		uint64_t bit_index = m_bits_readed - byte_index * 8;
-		byte >>= bit_index;
-		m_bits_readed++;
-		if (byte_index == m_length && m_bits_readed % 8 == 0)
-			m_eos = true;
-		return (uint32_t)byte & 1;
 	}
 public:
 	BitReader()
-		: m_data(NULL), m_bits_readed(0), m_length(0), m_eos(true), m_error(0)
+		: m_data(NULL), m_length(0), m_pos(0), m_value(0), m_bits(0), m_eos(true), m_error(false)
 	{
 
 	}
 	BitReader(const uint8_t * const data, size_t length)
-		: m_data(data), m_bits_readed(0), m_length(length), m_eos(false), m_error(false)
+		: m_data(data), m_length(length), m_pos(0), m_value(0), m_bits(0), m_eos(length == 0), m_error(false)
 	{
-
+		Fill();
 	}
-	uint32_t ReadBits(uint32_t n_bits)
+	/*
+	 * reset
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * начинает чтение нового потока, аналогично конструктору
+	 */
+	void reset(const uint8_t * const data, size_t length)
+	{
+		m_data = data;
+		m_length = length;
+		m_pos = 0;
+		m_value = 0;
+		m_bits = 0;
+		m_eos = length == 0;
+		m_error = false;
+		Fill();
+	}
+	/*
+	 * PeekBits
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * возвращает следующие n_bits(<= 32) бит не сдвигая позицию чтения, за концом потока читаются нули
+	 */
+	uint32_t PeekBits(uint32_t n_bits)
 	{
-		uint32_t ret;
-		memset(&ret, 0, sizeof(uint32_t));
-		for(uint32_t i = 0; i < n_bits; i++)
+		if (m_bits < n_bits)
+			Fill();
+		return (uint32_t)(m_value & (((uint64_t)1 << n_bits) - 1));
+	}
+	/*
+	 * SkipBits
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * сдвигает позицию чтения на n_bits(<= 32) бит
+	 */
+	void SkipBits(uint32_t n_bits)
+	{
+		if (m_bits < n_bits)
 		{
-			ret |= ReadBit() << i;
+			Fill();
+			if (m_bits < n_bits)
+			{
+				m_error = true;
+				m_eos = true;
+				m_value = 0;
+				m_bits = 0;
+				return;
+			}
 		}
+		m_value >>= n_bits;
+		m_bits -= n_bits;
+		if (m_bits == 0 && m_pos == m_length)
+			m_eos = true;
+	}
+	/*
+	 * ReadBits
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * читает n_bits(<= 32) бит
+	 */
+	uint32_t ReadBits(uint32_t n_bits)
+	{
+		const uint32_t ret = PeekBits(n_bits);
+		SkipBits(n_bits);
 		return ret;
 	}
+	//прочитано бит от начала потока
+	size_t position() const
+	{
+		return (m_pos << 3) - m_bits;
+	}
 	virtual ~BitReader()
 	{
 
 	}
-	bool eos()
+	bool eos() const
 	{
 		return m_eos;
 	}
-	bool error()
+	bool error() const
 	{
 		return m_error;
 	}
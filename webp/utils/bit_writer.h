@@ -5,7 +5,7 @@
 #include "../exception/exception.h"
 #include "utils.h"
 #include "bit_readed.h"
-#include <deque>
+#include <vector>
 #include <string>
 
 namespace webp
@@ -13,54 +13,81 @@ namespace webp
 namespace utils
 {
 
+//начальный размер буфера
 static const uint32_t BitWriterBufferArraySize = 16384;
 
 class BitWriterTest;
 
+/*
+ * Биты пишутся младшими вперед в 64-битный аккумулятор, который сбрасывается в буфер 32-битными словами.
+ * Буфер один и непрерывный, при нехватке места удваивается
+ */
 class BitWriter
 {
 private:
-	std::deque<byte_array>		m_buffer;
-	uint32_t					m_size;//байт в буфере
-	uint32_t					m_last_byte_index;//индекс на байт в который пишем биты
-	uint32_t					m_bits_writed_in_byte;//сколько бит записали в байт
-	void add_array()
+	//байты за пределами m_used используются как временное место под незаписанный хвост аккумулятора, см. data()
+	mutable std::vector<uint8_t>	m_buffer;
+	size_t							m_used;//байт сброшено в буфер
+	uint64_t						m_acc;//аккумулятор, младший бит пишется первым
+	uint32_t						m_acc_bits;//бит в аккумуляторе
+	void flush_word()
 	{
-		m_buffer.push_back(byte_array());
-		m_buffer.back().realloc(BitWriterBufferArraySize);
-		m_buffer.back().fill(0);
-		m_last_byte_index = 0;
-		m_bits_writed_in_byte = 0;
+		const uint32_t word = (uint32_t)m_acc;
+		memcpy(&m_buffer[m_used], &word, sizeof(uint32_t));
+		m_used += sizeof(uint32_t);
+		m_acc >>= 32;
+		m_acc_bits -= 32;
+		//после m_used всегда должно оставаться место под весь аккумулятор
+		if (m_used + sizeof(uint64_t) > m_buffer.size())
+			m_buffer.resize(m_buffer.size() * 2);
 	}
 public:
 	BitWriter()
-		: m_size(0), m_last_byte_index(0), m_bits_writed_in_byte(0)
+		: m_buffer(BitWriterBufferArraySize), m_used(0), m_acc(0), m_acc_bits(0)
 	{
 
 	}
 	virtual ~BitWriter()
 	{
 
+	}
+	/*
+	 * clear
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * начинает запись заново, буфер остается выделенным
+	 */
+	void clear()
+	{
+		m_used = 0;
+		m_acc = 0;
+		m_acc_bits = 0;
 	}
 	void WriteBit(const uint32_t & bit)
 	{
-		if (m_buffer.size() == 0)
-			add_array();
-		if ((m_last_byte_index == BitWriterBufferArraySize - 1) && (m_bits_writed_in_byte == 8))
-			add_array();
-		if (m_bits_writed_in_byte == 8)	{
-			m_last_byte_index++;
-			m_bits_writed_in_byte = 0;
-		}
-		if (m_bits_writed_in_byte == 0)
-			m_size++;
-		uint8_t * byte = &m_buffer.back()[m_last_byte_index];
-		*byte = *byte | ((bit & 1u) << m_bits_writed_in_byte++);
+		WriteBits(bit & 1u, 1);
 	}
+	//count <= 32
 	void WriteBits(const uint32_t & bits, const uint32_t & count)
 	{
-		for(uint32_t i = 0; i < count; i++)
-			WriteBit((bits >> i) & 1u);
+		m_acc |= ((uint64_t)bits & (((uint64_t)1 << count) - 1)) << m_acc_bits;
+		m_acc_bits += count;
+		if (m_acc_bits >= 32)
+			flush_word();
+	}
+	/*
+	 * data
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * возвращает указатель на size() записанных байт, последний байт дополнен нулями.
+	 * Указатель действителен до следующей записи
+	 */
+	const uint8_t * data() const
+	{
+		//в буфере всегда есть место под 8 байт после m_used
+		const uint64_t acc = m_acc;
+		memcpy(&m_buffer[m_used], &acc, sizeof(uint64_t));
+		return &m_buffer[0];
 	}
 	void save2file(const std::string & file_name) const
 	{
@@ -76,17 +103,17 @@ public:
 		if (fp == NULL)
 			throw exception::FileOperationException();
 
-		for(size_t i = 0; i < m_buffer.size() - 1; i++)
-			fwrite(&m_buffer.at(i)[0], BitWriterBufferArraySize, 1, fp);
-		int32_t last_array_index = m_buffer.size() - 1;
-		size_t prev_len = BitWriterBufferArraySize * last_array_index;
-		if (last_array_index != -1)
-			fwrite(&m_buffer.at(last_array_index)[0], m_size - prev_len, 1, fp);
+		if (size() != 0)
+			fwrite(data(), size(), 1, fp);
 
 		fclose(fp);
 	}
 	const size_t size() const{
-		return m_size;
+		return m_used + ((m_acc_bits + 7) >> 3);
+	}
+	//записано бит
+	const size_t bit_size() const{
+		return (m_used << 3) + m_acc_bits;
 	}
 	friend class BitWriterTest;
 };
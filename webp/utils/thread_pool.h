@@ -0,0 +1,154 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include "../platform.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+namespace webp
+{
+namespace utils
+{
+
+/*
+ * Пул потоков с очередью задач.
+ * Если потоков 0 или 1, то задачи выполняются сразу в вызывающем потоке, в том же порядке.
+ * Исключение, брошенное задачей, перебрасывается из wait()
+ */
+class ThreadPool
+{
+public:
+	typedef std::function<void()> task_t;
+private:
+	std::vector<std::thread>	m_workers;
+	std::deque<task_t>			m_tasks;
+	std::mutex					m_mutex;
+	std::condition_variable		m_task_added;
+	std::condition_variable		m_task_done;
+	size_t						m_pending;//задачи в очереди и выполняющиеся
+	bool						m_stop;
+	std::exception_ptr			m_exception;
+	ThreadPool(const ThreadPool &);
+	ThreadPool & operator=(const ThreadPool &);
+	void run(const task_t & task)
+	{
+		try
+		{
+			task();
+		}
+		catch(...)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_exception)
+				m_exception = std::current_exception();
+		}
+	}
+	void worker()
+	{
+		for(;;)
+		{
+			task_t task;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				while(!m_stop && m_tasks.empty())
+					m_task_added.wait(lock);
+				if (m_tasks.empty())
+					return;
+				task.swap(m_tasks.front());
+				m_tasks.pop_front();
+			}
+			run(task);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_pending == 0)
+				m_task_done.notify_all();
+		}
+	}
+	void rethrow()
+	{
+		std::exception_ptr exception;
+		exception.swap(m_exception);
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+public:
+	ThreadPool(const size_t & num_threads)
+		: m_pending(0), m_stop(false)
+	{
+		if (num_threads > 1)
+			for(size_t i = 0; i < num_threads; i++)
+				m_workers.push_back(std::thread(&ThreadPool::worker, this));
+	}
+	virtual ~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_task_added.notify_all();
+		for(size_t i = 0; i < m_workers.size(); i++)
+			m_workers[i].join();
+	}
+	/*
+	 * add
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * ставит задачу в очередь
+	 */
+	void add(const task_t & task)
+	{
+		if (m_workers.empty())
+		{
+			run(task);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(task);
+			m_pending++;
+		}
+		m_task_added.notify_one();
+	}
+	/*
+	 * wait
+	 * Бросает исключения: первое исключение, брошенное задачами
+	 * Назначение:
+	 * ждет завершения всех задач
+	 */
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(m_pending != 0)
+			m_task_done.wait(lock);
+		rethrow();
+	}
+	/*
+	 * parallel_for
+	 * Бросает исключения: первое исключение, брошенное задачами
+	 * Назначение:
+	 * вызывает body(i) для i из [0, count) и ждет завершения всех вызовов
+	 */
+	void parallel_for(const size_t & count, const std::function<void(size_t)> & body)
+	{
+		for(size_t i = 0; i < count; i++)
+			add(std::bind(body, i));
+		wait();
+	}
+	size_t size() const
+	{
+		return m_workers.empty() ? 1 : m_workers.size();
+	}
+	static size_t hardware_threads()
+	{
+		const size_t threads = std::thread::hardware_concurrency();
+		return threads == 0 ? 1 : threads;
+	}
+};
+
+}
+}
+
+#endif /* THREAD_POOL_H_ */
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include <algorithm>
 
 namespace webp
 {
@@ -52,6 +53,150 @@ void read_file(const std::string & file_name, uint32_t & file_length_out, array<
 	fclose(fp);
 }
 
+#ifdef LINUX
+MappedFile::MappedFile(const std::string & file_name)
+	: m_data(NULL), m_size(0)
+{
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw exception::FileOperationException();
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw exception::FileOperationException();
+	}
+	m_size = st.st_size;
+	//mmap не умеет отображать 0 байт, пустой файл - пустой буфер
+	if (m_size != 0)
+	{
+		void * data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			throw exception::FileOperationException();
+		}
+		m_data = (const uint8_t *)data;
+	}
+	//отображение остается действительным и после закрытия дескриптора
+	close(fd);
+}
+
+void MappedFile::release()
+{
+	if (m_data != NULL)
+		munmap((void *)m_data, m_size);
+	m_data = NULL;
+	m_size = 0;
+}
+#endif
+
+#ifdef WINDOWS
+MappedFile::MappedFile(const std::string & file_name)
+	: m_data(NULL), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+{
+	m_file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		throw exception::FileOperationException();
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size))
+	{
+		release();
+		throw exception::FileOperationException();
+	}
+	m_size = (size_t)size.QuadPart;
+	if (m_size != 0)
+	{
+		m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (m_mapping == NULL)
+		{
+			release();
+			throw exception::FileOperationException();
+		}
+		m_data = (const uint8_t *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (m_data == NULL)
+		{
+			release();
+			throw exception::FileOperationException();
+		}
+	}
+}
+
+void MappedFile::release()
+{
+	if (m_data != NULL)
+		UnmapViewOfFile(m_data);
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_data = NULL;
+	m_size = 0;
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+}
+#endif
+
+static bool has_extension(const std::string & name, const std::string & extension)
+{
+	return name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+#ifdef LINUX
+bool is_directory(const std::string & path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void list_directory(const std::string & dir, const std::string & extension, std::vector<std::string> & files)
+{
+	DIR * d = opendir(dir.c_str());
+	if (d == NULL)
+		throw exception::FileOperationException();
+	files.clear();
+	for(struct dirent * entry = readdir(d); entry != NULL; entry = readdir(d))
+	{
+		const std::string path = dir + "/" + entry->d_name;
+		struct stat st;
+		if (has_extension(entry->d_name, extension) && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			files.push_back(path);
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end());
+}
+#endif
+
+#ifdef WINDOWS
+bool is_directory(const std::string & path)
+{
+	const DWORD attributes = GetFileAttributesA(path.c_str());
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+}
+
+void list_directory(const std::string & dir, const std::string & extension, std::vector<std::string> & files)
+{
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+	if (find == INVALID_HANDLE_VALUE)
+		throw exception::FileOperationException();
+	files.clear();
+	do
+	{
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && has_extension(data.cFileName, extension))
+			files.push_back(dir + "\\" + data.cFileName);
+	}
+	while(FindNextFileA(find, &data));
+	FindClose(find);
+	std::sort(files.begin(), files.end());
+}
+#endif
+
+MappedFile::~MappedFile()
+{
+	release();
+}
+
 uint8_t * ALPHA(const uint32_t & argb)
 {
         return (uint8_t*)(&argb) + 3;
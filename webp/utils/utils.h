@@ -71,8 +71,11 @@ public:
 	{
 		release();
 	}
+	//содержимое после realloc не определено, буфер того же размера переиспользуется без выделения памяти
 	void realloc(const uint32_t & size)
 	{
+		if (m_array != NULL && m_size == size)
+			return;
 		release();
 		m_array = new T[size];
 		m_size = size;
@@ -118,6 +121,49 @@ uint8_t * BLUE(const uint32_t & argb);
 typedef uint8_t* (*COLOR_t)(const uint32_t & argb);
 static const COLOR_t COLOR[4] = {ALPHA, RED, GREEN, BLUE};
 void read_file(const std::string & file_name, uint32_t & file_length_out, array<uint8_t> & buf);
+bool is_directory(const std::string & path);
+/*
+ * list_directory
+ * Бросает исключения: FileOperationException
+ * Назначение:
+ * пишет в files пути обычных файлов каталога dir, имена которых заканчиваются на extension, по алфавиту
+ */
+void list_directory(const std::string & dir, const std::string & extension, std::vector<std::string> & files);
+
+/*
+ * Файл, отображенный в память только для чтения. Данные не копируются, указатель действителен,
+ * пока жив объект
+ */
+class MappedFile
+{
+private:
+	const uint8_t *		m_data;
+	size_t				m_size;
+#ifdef WINDOWS
+	HANDLE				m_file;
+	HANDLE				m_mapping;
+#endif
+	MappedFile(const MappedFile &);
+	MappedFile & operator=(const MappedFile &);
+	void release();
+public:
+	/*
+	 * MappedFile
+	 * Бросает исключения: FileOperationException
+	 * Назначение:
+	 * открывает файл и отображает его в память
+	 */
+	MappedFile(const std::string & file_name);
+	virtual ~MappedFile();
+	const uint8_t * data() const
+	{
+		return m_data;
+	}
+	const size_t & size() const
+	{
+		return m_size;
+	}
+};
 
 }
 }
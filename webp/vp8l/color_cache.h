@@ -39,12 +39,15 @@ public:
 			m_is_presented = true;
 		}
 	}
+	uint32_t key(const uint32_t & color) const
+	{
+		return (0x1e35a7bd * color) >> (32 - m_bits);
+	}
 	void insert(const uint32_t & color)
 	{
 		if (!m_is_presented)
 			return;
-		 uint32_t key = (0x1e35a7bd * color) >> (32 - m_bits);
-		 m_cache[key] = color;
+		 m_cache[key(color)] = color;
 	}
 	const uint32_t get(const uint32_t & key) const
 	{
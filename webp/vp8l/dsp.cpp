@@ -0,0 +1,821 @@
+#include "dsp.h"
+#include "transform.h"
+
+#ifdef DSP_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef WINDOWS
+#include <intrin.h>
+#endif
+#endif
+
+//функции с AVX2 компилируются для AVX2 независимо от флагов сборки, вызываются только если detect() его нашел
+#if defined(DSP_X86) && !defined(WINDOWS)
+#define DSP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define DSP_TARGET_AVX2
+#endif
+
+namespace webp
+{
+namespace vp8l
+{
+namespace dsp
+{
+
+/*
+ * Скалярные эталонные версии
+ */
+static void AddGreenToBlueAndRed_C(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		const uint32_t argb = in[i];
+		const uint32_t green = (argb >> 8) & 0xff;
+		//красная и синяя компоненты складываются с зеленой одновременно, переносы отсекаются маской
+		const uint32_t red_and_blue = ((argb & 0x00ff00ffu) + ((green << 16) | green)) & 0x00ff00ffu;
+		out[i] = (argb & 0xff00ff00u) | red_and_blue;
+	}
+}
+
+static void SubtractGreenFromBlueAndRed_C(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		const uint32_t argb = in[i];
+		const uint32_t green = (argb >> 8) & 0xff;
+		//старшие байты 0xff не дают заему перейти в соседнюю компоненту
+		const uint32_t red_and_blue = ((argb | 0xff00ff00u) - ((green << 16) | green)) & 0x00ff00ffu;
+		out[i] = (argb & 0xff00ff00u) | red_and_blue;
+	}
+}
+
+static void TransformColorInverse_C(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		uint32_t argb = in[i];
+		uint8_t red = *utils::RED(argb);
+		const uint8_t green = *utils::GREEN(argb);
+		uint8_t blue = *utils::BLUE(argb);
+
+		//еще один косяк документации, в написано, что надо вычитать
+		red  += ColorTransformDelta(cte.green_to_red,  green);
+		blue += ColorTransformDelta(cte.green_to_blue, green);
+		blue += ColorTransformDelta(cte.red_to_blue, red);
+
+		*utils::RED(argb) = red;
+		*utils::BLUE(argb) = blue;
+		out[i] = argb;
+	}
+}
+
+static void TransformColor_C(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		uint32_t argb = in[i];
+		const uint8_t red = *utils::RED(argb);
+		const uint8_t green = *utils::GREEN(argb);
+		const uint8_t blue = *utils::BLUE(argb);
+
+		//поправки считаются от исходного красного, его же декодер восстанавливает перед синим
+		*utils::RED(argb) = red - ColorTransformDelta(cte.green_to_red, green);
+		*utils::BLUE(argb) = blue - ColorTransformDelta(cte.green_to_blue, green) - ColorTransformDelta(cte.red_to_blue, red);
+		out[i] = argb;
+	}
+}
+
+template <uint32_t mode>
+static void PredictorAdd_C(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		uint32_t argb = in[i];
+		PixelsSum(&argb, Predict(mode, out[i - 1], top[i], top[i + 1], top[i - 1]));
+		out[i] = argb;
+	}
+}
+
+template <uint32_t mode>
+static void PredictorSub_C(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		uint32_t residual = in[i];
+		PixelsSub(&residual, Predict(mode, in[i - 1], top[i], top[i + 1], top[i - 1]));
+		out[i] = residual;
+	}
+}
+
+#define PREDICTOR_TABLE(name) {																		\
+	name<0>, name<1>, name<2>, name<3>, name<4>, name<5>, name<6>,									\
+	name<7>, name<8>, name<9>, name<10>, name<11>, name<12>, name<13>								\
+}
+
+static const PredictorAddFunc PredictorAdd_C_table[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorAdd_C);
+static const PredictorSubFunc PredictorSub_C_table[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorSub_C);
+
+#ifdef DSP_X86
+//множитель cross color transform, расширенный до 16 бит и сдвинутый так, чтобы mulhi_epi16 давал (t * c) >> 5
+#define COLOR_MULTIPLIER(t) ((int16_t)((int16_t)((uint16_t)(t) << 8) >> 5))
+#define COLOR_MULTIPLIERS(hi, lo) ((int32_t)(((uint32_t)(uint16_t)(hi) << 16) | (uint16_t)(lo)))
+
+/*
+ * SSE2
+ */
+//побайтное среднее с округлением вниз, как Average2: _mm_avg_epu8 округляет вверх
+static inline __m128i Average2_SSE2(const __m128i & a, const __m128i & b)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+}
+
+//сумма модулей разностей компонент a и b для каждого пикселя
+static inline __m128i SumAbsDiff_SSE2(const __m128i & a, const __m128i & b)
+{
+	const __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+	const __m128i pairs = _mm_add_epi16(_mm_and_si128(diff, _mm_set1_epi16(0x00ff)), _mm_srli_epi16(diff, 8));
+	return _mm_add_epi32(_mm_and_si128(pairs, _mm_set1_epi32(0x0000ffff)), _mm_srli_epi32(pairs, 16));
+}
+
+//L + T - TL с насыщением
+static inline __m128i ClampAddSubtractFull_SSE2(const __m128i & L, const __m128i & T, const __m128i & TL)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(L, zero), _mm_sub_epi16(_mm_unpacklo_epi8(T, zero), _mm_unpacklo_epi8(TL, zero)));
+	const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(L, zero), _mm_sub_epi16(_mm_unpackhi_epi8(T, zero), _mm_unpackhi_epi8(TL, zero)));
+	return _mm_packus_epi16(lo, hi);
+}
+
+//a + (a - b) / 2 с насыщением, деление округляет к нулю
+static inline __m128i ClampAddSubtractHalf16_SSE2(const __m128i & a, const __m128i & b)
+{
+	const __m128i diff = _mm_sub_epi16(a, b);
+	return _mm_add_epi16(a, _mm_srai_epi16(_mm_add_epi16(diff, _mm_srli_epi16(diff, 15)), 1));
+}
+
+static inline __m128i ClampAddSubtractHalf_SSE2(const __m128i & a, const __m128i & b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = ClampAddSubtractHalf16_SSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	const __m128i hi = ClampAddSubtractHalf16_SSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+	return _mm_packus_epi16(lo, hi);
+}
+
+/*
+ * Predict_SSE2
+ * Бросает исключения: нет
+ * Назначение:
+ * предсказание режимом mode для 4 пикселей подряд, left - левые соседи(не читается режимами, которым не нужен)
+ */
+template <uint32_t mode>
+static inline __m128i Predict_SSE2(const uint32_t * left, const uint32_t * top)
+{
+	#define LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+	switch(mode)
+	{
+		case 0:
+			return _mm_set1_epi32((int)0xff000000);
+		case 1:
+			return LOAD(left);
+		case 2:
+			return LOAD(top);
+		case 3:
+			return LOAD(top + 1);
+		case 4:
+			return LOAD(top - 1);
+		case 5:
+			return Average2_SSE2(Average2_SSE2(LOAD(left), LOAD(top + 1)), LOAD(top));
+		case 6:
+			return Average2_SSE2(LOAD(left), LOAD(top - 1));
+		case 7:
+			return Average2_SSE2(LOAD(left), LOAD(top));
+		case 8:
+			return Average2_SSE2(LOAD(top - 1), LOAD(top));
+		case 9:
+			return Average2_SSE2(LOAD(top), LOAD(top + 1));
+		case 10:
+			return Average2_SSE2(Average2_SSE2(LOAD(left), LOAD(top - 1)), Average2_SSE2(LOAD(top), LOAD(top + 1)));
+		case 11:
+		{
+			//см. Select: T, если L не дальше от TL, чем T, иначе L
+			const __m128i L = LOAD(left);
+			const __m128i T = LOAD(top);
+			const __m128i TL = LOAD(top - 1);
+			const __m128i use_left = _mm_cmpgt_epi32(SumAbsDiff_SSE2(L, TL), SumAbsDiff_SSE2(T, TL));
+			return _mm_or_si128(_mm_and_si128(use_left, L), _mm_andnot_si128(use_left, T));
+		}
+		case 12:
+			return ClampAddSubtractFull_SSE2(LOAD(left), LOAD(top), LOAD(top - 1));
+		default://13
+			return ClampAddSubtractHalf_SSE2(Average2_SSE2(LOAD(left), LOAD(top)), LOAD(top - 1));
+	}
+	#undef LOAD
+}
+
+static void AddGreenToBlueAndRed_SSE2(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i argb = _mm_loadu_si128((const __m128i *)&in[i]);
+		//0 a 0 g -> 0 g 0 g
+		const __m128i ag = _mm_srli_epi16(argb, 8);
+		const __m128i gg = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		_mm_storeu_si128((__m128i *)&out[i], _mm_add_epi8(argb, gg));
+	}
+	AddGreenToBlueAndRed_C(in + i, out + i, num_pixels - i);
+}
+
+static void SubtractGreenFromBlueAndRed_SSE2(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i argb = _mm_loadu_si128((const __m128i *)&in[i]);
+		const __m128i ag = _mm_srli_epi16(argb, 8);
+		const __m128i gg = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		_mm_storeu_si128((__m128i *)&out[i], _mm_sub_epi8(argb, gg));
+	}
+	SubtractGreenFromBlueAndRed_C(in + i, out + i, num_pixels - i);
+}
+
+static void TransformColorInverse_SSE2(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	const __m128i mults_rb = _mm_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.green_to_red), COLOR_MULTIPLIER(cte.green_to_blue)));
+	const __m128i mults_b2 = _mm_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.red_to_blue), 0));
+	const __m128i mask_ag = _mm_set1_epi32((int)0xff00ff00);
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i argb = _mm_loadu_si128((const __m128i *)&in[i]);
+		const __m128i ag = _mm_and_si128(argb, mask_ag);								// a 0 g 0
+		const __m128i gg = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));	// g 0 g 0
+		const __m128i deltas = _mm_mulhi_epi16(gg, mults_rb);						// x dr x db1
+		const __m128i rb = _mm_slli_epi16(_mm_add_epi8(argb, deltas), 8);			// r' 0 b' 0
+		const __m128i delta_b2 = _mm_srli_epi32(_mm_mulhi_epi16(rb, mults_b2), 8);	// 0 x db2 0
+		const __m128i rb2 = _mm_srli_epi16(_mm_add_epi8(delta_b2, rb), 8);			// 0 r' 0 b''
+		_mm_storeu_si128((__m128i *)&out[i], _mm_or_si128(rb2, ag));
+	}
+	TransformColorInverse_C(cte, in + i, out + i, num_pixels - i);
+}
+
+static void TransformColor_SSE2(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	const __m128i mults_rb = _mm_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.green_to_red), COLOR_MULTIPLIER(cte.green_to_blue)));
+	const __m128i mults_b2 = _mm_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.red_to_blue), 0));
+	const __m128i mask_ag = _mm_set1_epi32((int)0xff00ff00);
+	const __m128i mask_rb = _mm_set1_epi32(0x00ff00ff);
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i argb = _mm_loadu_si128((const __m128i *)&in[i]);
+		const __m128i ag = _mm_and_si128(argb, mask_ag);								// a 0 g 0
+		const __m128i gg = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));	// g 0 g 0
+		const __m128i deltas = _mm_mulhi_epi16(gg, mults_rb);						// x dr x db1
+		const __m128i rb = _mm_slli_epi16(argb, 8);									// r 0 b 0
+		const __m128i delta_b2 = _mm_srli_epi32(_mm_mulhi_epi16(rb, mults_b2), 16);	// 0 0 x db2
+		const __m128i delta = _mm_and_si128(_mm_add_epi8(delta_b2, deltas), mask_rb);	// 0 dr 0 db
+		_mm_storeu_si128((__m128i *)&out[i], _mm_sub_epi8(argb, delta));
+	}
+	TransformColor_C(cte, in + i, out + i, num_pixels - i);
+}
+
+//режимы, не зависящие от левого соседа(0, 2, 3, 4, 8, 9): 4 пикселя за раз
+template <uint32_t mode>
+static void PredictorAddParallel_SSE2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i residual = _mm_loadu_si128((const __m128i *)&in[i]);
+		_mm_storeu_si128((__m128i *)&out[i], _mm_add_epi8(residual, Predict_SSE2<mode>(NULL, top + i)));
+	}
+	PredictorAdd_C<mode>(in + i, top + i, num_pixels - i, out + i);
+}
+
+//режим 1(левый сосед): префиксная сумма внутри 4 пикселей плюс последний восстановленный пиксель
+static void PredictorAdd1_SSE2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	__m128i prev = _mm_set1_epi32((int)out[-1]);
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i residual = _mm_loadu_si128((const __m128i *)&in[i]);
+		const __m128i sum0 = _mm_add_epi8(residual, _mm_slli_si128(residual, 4));
+		const __m128i sum1 = _mm_add_epi8(sum0, _mm_slli_si128(sum0, 8));
+		const __m128i argb = _mm_add_epi8(sum1, prev);
+		_mm_storeu_si128((__m128i *)&out[i], argb);
+		prev = _mm_shuffle_epi32(argb, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	PredictorAdd_C<1>(in + i, top + i, num_pixels - i, out + i);
+}
+
+//режимы, зависящие от левого соседа: по пикселю, левый сосед не покидает регистр.
+//Старшие байты регистров нулевые, это нужно _mm_sad_epu8 в режиме 11
+template <uint32_t mode>
+static inline __m128i PredictSerial_SSE2(const __m128i & L, const uint32_t * top)
+{
+	const __m128i T = _mm_cvtsi32_si128((int)top[0]);
+	switch(mode)
+	{
+		case 5:
+			return Average2_SSE2(Average2_SSE2(L, _mm_cvtsi32_si128((int)top[1])), T);
+		case 6:
+			return Average2_SSE2(L, _mm_cvtsi32_si128((int)top[-1]));
+		case 7:
+			return Average2_SSE2(L, T);
+		case 10:
+			return Average2_SSE2(Average2_SSE2(L, _mm_cvtsi32_si128((int)top[-1])), Average2_SSE2(T, _mm_cvtsi32_si128((int)top[1])));
+		case 11:
+		{
+			//см. Select: сравниваются манхэттенские расстояния L и T до TL
+			const __m128i TL = _mm_cvtsi32_si128((int)top[-1]);
+			const int32_t pL = _mm_cvtsi128_si32(_mm_sad_epu8(L, TL));
+			const int32_t pT = _mm_cvtsi128_si32(_mm_sad_epu8(T, TL));
+			return pL <= pT ? T : L;
+		}
+		case 12:
+			return ClampAddSubtractFull_SSE2(L, T, _mm_cvtsi32_si128((int)top[-1]));
+		default://13
+			return ClampAddSubtractHalf_SSE2(Average2_SSE2(L, T), _mm_cvtsi32_si128((int)top[-1]));
+	}
+}
+
+template <uint32_t mode>
+static void PredictorAddSerial_SSE2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	__m128i L = _mm_cvtsi32_si128((int)out[-1]);
+	for(size_t i = 0; i < num_pixels; i++)
+	{
+		L = _mm_add_epi8(_mm_cvtsi32_si128((int)in[i]), PredictSerial_SSE2<mode>(L, top + i));
+		out[i] = (uint32_t)_mm_cvtsi128_si32(L);
+	}
+}
+
+//в прямом направлении все соседи известны заранее, поэтому параллельны все режимы
+template <uint32_t mode>
+static void PredictorSub_SSE2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	size_t i = 0;
+	for(; i + 4 <= num_pixels; i += 4)
+	{
+		const __m128i argb = _mm_loadu_si128((const __m128i *)&in[i]);
+		_mm_storeu_si128((__m128i *)&out[i], _mm_sub_epi8(argb, Predict_SSE2<mode>(in + i - 1, top + i)));
+	}
+	PredictorSub_C<mode>(in + i, top + i, num_pixels - i, out + i);
+}
+
+static const PredictorAddFunc PredictorAdd_SSE2_table[PREDICTOR_MODES_COUNT] = {
+	PredictorAddParallel_SSE2<0>, PredictorAdd1_SSE2, PredictorAddParallel_SSE2<2>, PredictorAddParallel_SSE2<3>,
+	PredictorAddParallel_SSE2<4>, PredictorAddSerial_SSE2<5>, PredictorAddSerial_SSE2<6>, PredictorAddSerial_SSE2<7>,
+	PredictorAddParallel_SSE2<8>, PredictorAddParallel_SSE2<9>, PredictorAddSerial_SSE2<10>, PredictorAddSerial_SSE2<11>,
+	PredictorAddSerial_SSE2<12>, PredictorAddSerial_SSE2<13>
+};
+static const PredictorSubFunc PredictorSub_SSE2_table[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorSub_SSE2);
+
+/*
+ * AVX2, те же приемы на 8 пикселях. Распаковка и упаковка в AVX2 работают внутри 128-битных половин,
+ * поэтому пары unpack/packus сохраняют порядок пикселей. Хвосты дорабатывают SSE2 версии
+ */
+DSP_TARGET_AVX2 static inline __m256i Average2_AVX2(const __m256i & a, const __m256i & b)
+{
+	const __m256i one = _mm256_set1_epi8(1);
+	return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+}
+
+DSP_TARGET_AVX2 static inline __m256i SumAbsDiff_AVX2(const __m256i & a, const __m256i & b)
+{
+	const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+	const __m256i pairs = _mm256_add_epi16(_mm256_and_si256(diff, _mm256_set1_epi16(0x00ff)), _mm256_srli_epi16(diff, 8));
+	return _mm256_add_epi32(_mm256_and_si256(pairs, _mm256_set1_epi32(0x0000ffff)), _mm256_srli_epi32(pairs, 16));
+}
+
+DSP_TARGET_AVX2 static inline __m256i ClampAddSubtractFull_AVX2(const __m256i & L, const __m256i & T, const __m256i & TL)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(L, zero),
+										_mm256_sub_epi16(_mm256_unpacklo_epi8(T, zero), _mm256_unpacklo_epi8(TL, zero)));
+	const __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(L, zero),
+										_mm256_sub_epi16(_mm256_unpackhi_epi8(T, zero), _mm256_unpackhi_epi8(TL, zero)));
+	return _mm256_packus_epi16(lo, hi);
+}
+
+DSP_TARGET_AVX2 static inline __m256i ClampAddSubtractHalf16_AVX2(const __m256i & a, const __m256i & b)
+{
+	const __m256i diff = _mm256_sub_epi16(a, b);
+	return _mm256_add_epi16(a, _mm256_srai_epi16(_mm256_add_epi16(diff, _mm256_srli_epi16(diff, 15)), 1));
+}
+
+DSP_TARGET_AVX2 static inline __m256i ClampAddSubtractHalf_AVX2(const __m256i & a, const __m256i & b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lo = ClampAddSubtractHalf16_AVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+	const __m256i hi = ClampAddSubtractHalf16_AVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+	return _mm256_packus_epi16(lo, hi);
+}
+
+template <uint32_t mode>
+DSP_TARGET_AVX2 static inline __m256i Predict_AVX2(const uint32_t * left, const uint32_t * top)
+{
+	#define LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+	switch(mode)
+	{
+		case 0:
+			return _mm256_set1_epi32((int)0xff000000);
+		case 1:
+			return LOAD(left);
+		case 2:
+			return LOAD(top);
+		case 3:
+			return LOAD(top + 1);
+		case 4:
+			return LOAD(top - 1);
+		case 5:
+			return Average2_AVX2(Average2_AVX2(LOAD(left), LOAD(top + 1)), LOAD(top));
+		case 6:
+			return Average2_AVX2(LOAD(left), LOAD(top - 1));
+		case 7:
+			return Average2_AVX2(LOAD(left), LOAD(top));
+		case 8:
+			return Average2_AVX2(LOAD(top - 1), LOAD(top));
+		case 9:
+			return Average2_AVX2(LOAD(top), LOAD(top + 1));
+		case 10:
+			return Average2_AVX2(Average2_AVX2(LOAD(left), LOAD(top - 1)), Average2_AVX2(LOAD(top), LOAD(top + 1)));
+		case 11:
+		{
+			const __m256i L = LOAD(left);
+			const __m256i T = LOAD(top);
+			const __m256i TL = LOAD(top - 1);
+			const __m256i use_left = _mm256_cmpgt_epi32(SumAbsDiff_AVX2(L, TL), SumAbsDiff_AVX2(T, TL));
+			return _mm256_blendv_epi8(T, L, use_left);
+		}
+		case 12:
+			return ClampAddSubtractFull_AVX2(LOAD(left), LOAD(top), LOAD(top - 1));
+		default://13
+			return ClampAddSubtractHalf_AVX2(Average2_AVX2(LOAD(left), LOAD(top)), LOAD(top - 1));
+	}
+	#undef LOAD
+}
+
+DSP_TARGET_AVX2 static void AddGreenToBlueAndRed_AVX2(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i argb = _mm256_loadu_si256((const __m256i *)&in[i]);
+		const __m256i ag = _mm256_srli_epi16(argb, 8);
+		const __m256i gg = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_add_epi8(argb, gg));
+	}
+	AddGreenToBlueAndRed_SSE2(in + i, out + i, num_pixels - i);
+}
+
+DSP_TARGET_AVX2 static void SubtractGreenFromBlueAndRed_AVX2(const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i argb = _mm256_loadu_si256((const __m256i *)&in[i]);
+		const __m256i ag = _mm256_srli_epi16(argb, 8);
+		const __m256i gg = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_sub_epi8(argb, gg));
+	}
+	SubtractGreenFromBlueAndRed_SSE2(in + i, out + i, num_pixels - i);
+}
+
+DSP_TARGET_AVX2 static void TransformColorInverse_AVX2(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	const __m256i mults_rb = _mm256_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.green_to_red), COLOR_MULTIPLIER(cte.green_to_blue)));
+	const __m256i mults_b2 = _mm256_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.red_to_blue), 0));
+	const __m256i mask_ag = _mm256_set1_epi32((int)0xff00ff00);
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i argb = _mm256_loadu_si256((const __m256i *)&in[i]);
+		const __m256i ag = _mm256_and_si256(argb, mask_ag);
+		const __m256i gg = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		const __m256i deltas = _mm256_mulhi_epi16(gg, mults_rb);
+		const __m256i rb = _mm256_slli_epi16(_mm256_add_epi8(argb, deltas), 8);
+		const __m256i delta_b2 = _mm256_srli_epi32(_mm256_mulhi_epi16(rb, mults_b2), 8);
+		const __m256i rb2 = _mm256_srli_epi16(_mm256_add_epi8(delta_b2, rb), 8);
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(rb2, ag));
+	}
+	TransformColorInverse_SSE2(cte, in + i, out + i, num_pixels - i);
+}
+
+DSP_TARGET_AVX2 static void TransformColor_AVX2(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels)
+{
+	const __m256i mults_rb = _mm256_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.green_to_red), COLOR_MULTIPLIER(cte.green_to_blue)));
+	const __m256i mults_b2 = _mm256_set1_epi32(COLOR_MULTIPLIERS(COLOR_MULTIPLIER(cte.red_to_blue), 0));
+	const __m256i mask_ag = _mm256_set1_epi32((int)0xff00ff00);
+	const __m256i mask_rb = _mm256_set1_epi32(0x00ff00ff);
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i argb = _mm256_loadu_si256((const __m256i *)&in[i]);
+		const __m256i ag = _mm256_and_si256(argb, mask_ag);
+		const __m256i gg = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ag, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		const __m256i deltas = _mm256_mulhi_epi16(gg, mults_rb);
+		const __m256i rb = _mm256_slli_epi16(argb, 8);
+		const __m256i delta_b2 = _mm256_srli_epi32(_mm256_mulhi_epi16(rb, mults_b2), 16);
+		const __m256i delta = _mm256_and_si256(_mm256_add_epi8(delta_b2, deltas), mask_rb);
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_sub_epi8(argb, delta));
+	}
+	TransformColor_SSE2(cte, in + i, out + i, num_pixels - i);
+}
+
+template <uint32_t mode>
+DSP_TARGET_AVX2 static void PredictorAddParallel_AVX2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i residual = _mm256_loadu_si256((const __m256i *)&in[i]);
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_add_epi8(residual, Predict_AVX2<mode>(NULL, top + i)));
+	}
+	PredictorAddParallel_SSE2<mode>(in + i, top + i, num_pixels - i, out + i);
+}
+
+template <uint32_t mode>
+DSP_TARGET_AVX2 static void PredictorSub_AVX2(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out)
+{
+	size_t i = 0;
+	for(; i + 8 <= num_pixels; i += 8)
+	{
+		const __m256i argb = _mm256_loadu_si256((const __m256i *)&in[i]);
+		_mm256_storeu_si256((__m256i *)&out[i], _mm256_sub_epi8(argb, Predict_AVX2<mode>(in + i - 1, top + i)));
+	}
+	PredictorSub_SSE2<mode>(in + i, top + i, num_pixels - i, out + i);
+}
+
+static const PredictorAddFunc PredictorAdd_AVX2_table[PREDICTOR_MODES_COUNT] = {
+	PredictorAddParallel_AVX2<0>, PredictorAdd1_SSE2, PredictorAddParallel_AVX2<2>, PredictorAddParallel_AVX2<3>,
+	PredictorAddParallel_AVX2<4>, PredictorAddSerial_SSE2<5>, PredictorAddSerial_SSE2<6>, PredictorAddSerial_SSE2<7>,
+	PredictorAddParallel_AVX2<8>, PredictorAddParallel_AVX2<9>, PredictorAddSerial_SSE2<10>, PredictorAddSerial_SSE2<11>,
+	PredictorAddSerial_SSE2<12>, PredictorAddSerial_SSE2<13>
+};
+static const PredictorSubFunc PredictorSub_AVX2_table[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorSub_AVX2);
+#endif
+
+AddGreenToBlueAndRedFunc		AddGreenToBlueAndRed = AddGreenToBlueAndRed_C;
+TransformColorInverseFunc		TransformColorInverse = TransformColorInverse_C;
+PredictorAddFunc				PredictorAdd[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorAdd_C);
+SubtractGreenFromBlueAndRedFunc	SubtractGreenFromBlueAndRed = SubtractGreenFromBlueAndRed_C;
+TransformColorFunc				TransformColor = TransformColor_C;
+PredictorSubFunc				PredictorSub[PREDICTOR_MODES_COUNT] = PREDICTOR_TABLE(PredictorSub_C);
+
+CPU_FEATURES detect()
+{
+#ifdef DSP_X86
+#ifdef WINDOWS
+	int info[4];
+	__cpuid(info, 0);
+	const int max_leaf = info[0];
+	__cpuid(info, 1);
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	//AVX2 нужна поддержка ОС: OSXSAVE и сохранение регистров XMM/YMM
+	const bool os_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+	if (max_leaf >= 7 && os_ymm)
+	{
+		__cpuidex(info, 7, 0);
+		if ((info[1] & (1 << 5)) != 0)
+			return CPU_AVX2;
+	}
+	return sse2 ? CPU_SSE2 : CPU_SCALAR;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return CPU_SSE2;
+#endif
+#endif
+	return CPU_SCALAR;
+}
+
+//указатели на ядра одного уровня
+struct KERNELS
+{
+	AddGreenToBlueAndRedFunc			add_green;
+	TransformColorInverseFunc			color_inverse;
+	const PredictorAddFunc *			predictor_add;
+	SubtractGreenFromBlueAndRedFunc		subtract_green;
+	TransformColorFunc					color;
+	const PredictorSubFunc *			predictor_sub;
+};
+
+static void select(const CPU_FEATURES & level, KERNELS & kernels)
+{
+	kernels.add_green = AddGreenToBlueAndRed_C;
+	kernels.color_inverse = TransformColorInverse_C;
+	kernels.predictor_add = PredictorAdd_C_table;
+	kernels.subtract_green = SubtractGreenFromBlueAndRed_C;
+	kernels.color = TransformColor_C;
+	kernels.predictor_sub = PredictorSub_C_table;
+#ifdef DSP_X86
+	if (level >= CPU_SSE2)
+	{
+		kernels.add_green = AddGreenToBlueAndRed_SSE2;
+		kernels.color_inverse = TransformColorInverse_SSE2;
+		kernels.predictor_add = PredictorAdd_SSE2_table;
+		kernels.subtract_green = SubtractGreenFromBlueAndRed_SSE2;
+		kernels.color = TransformColor_SSE2;
+		kernels.predictor_sub = PredictorSub_SSE2_table;
+	}
+	if (level >= CPU_AVX2)
+	{
+		kernels.add_green = AddGreenToBlueAndRed_AVX2;
+		kernels.color_inverse = TransformColorInverse_AVX2;
+		kernels.predictor_add = PredictorAdd_AVX2_table;
+		kernels.subtract_green = SubtractGreenFromBlueAndRed_AVX2;
+		kernels.color = TransformColor_AVX2;
+		kernels.predictor_sub = PredictorSub_AVX2_table;
+	}
+#endif
+}
+
+void init(const CPU_FEATURES & level)
+{
+	KERNELS kernels;
+	select(level, kernels);
+	AddGreenToBlueAndRed = kernels.add_green;
+	TransformColorInverse = kernels.color_inverse;
+	SubtractGreenFromBlueAndRed = kernels.subtract_green;
+	TransformColor = kernels.color;
+	for(size_t mode = 0; mode < PREDICTOR_MODES_COUNT; mode++)
+	{
+		PredictorAdd[mode] = kernels.predictor_add[mode];
+		PredictorSub[mode] = kernels.predictor_sub[mode];
+	}
+}
+
+/*
+ * Сверка ядер уровня со скалярными на случайных отрезках всех длин до VERIFY_MAX_LENGTH и всех смещений
+ * до VERIFY_MAX_OFFSET относительно выравнивания, в другой буфер и на месте, плюс обратимость прямых ядер обратными
+ */
+#define VERIFY_MAX_LENGTH 80
+#define VERIFY_MAX_OFFSET 8
+//с запасом под in[-1], top[-1] и top[num_pixels]
+#define VERIFY_GUARD 16
+#define VERIFY_BUFFER_SIZE (VERIFY_MAX_LENGTH + 2 * VERIFY_GUARD)
+
+class Verifier
+{
+private:
+	const char *	m_level;
+	KERNELS			m_ref;
+	KERNELS			m_simd;
+	uint32_t		m_random;
+	size_t			m_cases;
+	size_t			m_failures;
+	uint32_t		m_in[VERIFY_BUFFER_SIZE];
+	uint32_t		m_top[VERIFY_BUFFER_SIZE];
+	uint32_t		m_ref_out[VERIFY_BUFFER_SIZE];
+	uint32_t		m_simd_out[VERIFY_BUFFER_SIZE];
+	//линейный конгруэнтный генератор, чтобы случаи не зависели от реализации rand()
+	uint32_t next(const uint32_t & n)
+	{
+		m_random = m_random * 1664525u + 1013904223u;
+		return (m_random >> 8) % n;
+	}
+	uint32_t next()
+	{
+		return (next(1u << 24) << 8) | next(256);
+	}
+	//случайные пиксели вперемешку с близкими к соседу, чтобы ветки clamp/select/average предсказателей срабатывали обе
+	uint32_t pixel(const uint32_t & near)
+	{
+		if (next(2) == 0)
+			return next();
+		uint32_t argb = near;
+		for(uint32_t c = 0; c < 32; c += 8)
+			argb = (argb & ~(0xffu << c)) | (((((argb >> c) & 0xff) + next(5) - 2) & 0xff) << c);
+		return argb;
+	}
+	void fill(uint32_t * buffer)
+	{
+		buffer[0] = next();
+		for(size_t i = 1; i < VERIFY_BUFFER_SIZE; i++)
+			buffer[i] = pixel(buffer[i - 1]);
+	}
+	void check(const char * kernel, const int & mode, const size_t & length, const size_t & offset,
+				const uint32_t * expected, const uint32_t * actual)
+	{
+		m_cases++;
+		for(size_t i = 0; i < length; i++)
+			if (expected[i] != actual[i])
+			{
+				if (m_failures++ < 10)
+					printf("dsp verify %s: %s mode %d length %u offset %u pixel %u: expected %08x, got %08x\n", m_level, kernel, mode,
+							(uint32_t)length, (uint32_t)offset, (uint32_t)i, expected[i], actual[i]);
+				return;
+			}
+	}
+	void verify(const size_t & length, const size_t & offset)
+	{
+		uint32_t * in = m_in + VERIFY_GUARD - VERIFY_MAX_OFFSET + offset;
+		uint32_t * top = m_top + VERIFY_GUARD - VERIFY_MAX_OFFSET + offset;
+		uint32_t * ref = m_ref_out + VERIFY_GUARD - VERIFY_MAX_OFFSET + offset;
+		uint32_t * simd = m_simd_out + VERIFY_GUARD - VERIFY_MAX_OFFSET + offset;
+		fill(m_in);
+		fill(m_top);
+		const ColorTransformElement cte(next());
+
+		m_ref.add_green(in, ref, length);
+		m_simd.add_green(in, simd, length);
+		check("AddGreenToBlueAndRed", -1, length, offset, ref, simd);
+		memcpy(simd, in, length * sizeof(uint32_t));
+		m_simd.add_green(simd, simd, length);
+		check("AddGreenToBlueAndRed(in place)", -1, length, offset, ref, simd);
+		m_simd.subtract_green(simd, simd, length);
+		check("SubtractGreenFromBlueAndRed(round trip)", -1, length, offset, in, simd);
+
+		m_ref.subtract_green(in, ref, length);
+		m_simd.subtract_green(in, simd, length);
+		check("SubtractGreenFromBlueAndRed", -1, length, offset, ref, simd);
+		memcpy(simd, in, length * sizeof(uint32_t));
+		m_simd.subtract_green(simd, simd, length);
+		check("SubtractGreenFromBlueAndRed(in place)", -1, length, offset, ref, simd);
+
+		m_ref.color_inverse(cte, in, ref, length);
+		m_simd.color_inverse(cte, in, simd, length);
+		check("TransformColorInverse", -1, length, offset, ref, simd);
+		memcpy(simd, in, length * sizeof(uint32_t));
+		m_simd.color_inverse(cte, simd, simd, length);
+		check("TransformColorInverse(in place)", -1, length, offset, ref, simd);
+
+		m_ref.color(cte, in, ref, length);
+		m_simd.color(cte, in, simd, length);
+		check("TransformColor", -1, length, offset, ref, simd);
+		memcpy(simd, in, length * sizeof(uint32_t));
+		m_simd.color(cte, simd, simd, length);
+		check("TransformColor(in place)", -1, length, offset, ref, simd);
+		m_simd.color_inverse(cte, simd, simd, length);
+		check("TransformColor(round trip)", -1, length, offset, in, simd);
+
+		for(int mode = 0; mode < PREDICTOR_MODES_COUNT; mode++)
+		{
+			//left для первого пикселя берется из out[-1]
+			ref[-1] = simd[-1] = in[-1];
+			m_ref.predictor_add[mode](in, top, length, ref);
+			m_simd.predictor_add[mode](in, top, length, simd);
+			check("PredictorAdd", mode, length, offset, ref, simd);
+			memcpy(simd - 1, in - 1, (length + 1) * sizeof(uint32_t));
+			m_simd.predictor_add[mode](simd, top, length, simd);
+			check("PredictorAdd(in place)", mode, length, offset, ref, simd);
+
+			m_ref.predictor_sub[mode](in, top, length, ref);
+			m_simd.predictor_sub[mode](in, top, length, simd);
+			check("PredictorSub", mode, length, offset, ref, simd);
+			//остатки складываются обратно в исходные пиксели
+			uint32_t * restored = m_ref_out + VERIFY_GUARD - VERIFY_MAX_OFFSET + offset;
+			restored[-1] = in[-1];
+			m_simd.predictor_add[mode](simd, top, length, restored);
+			check("PredictorSub(round trip)", mode, length, offset, in, restored);
+		}
+	}
+public:
+	Verifier(const char * level_name, const CPU_FEATURES & level)
+		: m_level(level_name), m_random(0x5eed), m_cases(0), m_failures(0)
+	{
+		select(CPU_SCALAR, m_ref);
+		select(level, m_simd);
+	}
+	size_t run(const size_t & rounds)
+	{
+		for(size_t round = 0; round < rounds; round++)
+			for(size_t length = 0; length <= VERIFY_MAX_LENGTH; length++)
+				for(size_t offset = 0; offset < VERIFY_MAX_OFFSET; offset++)
+					verify(length, offset);
+		printf("dsp verify %s: %u cases, %u mismatches\n", m_level, (uint32_t)m_cases, (uint32_t)m_failures);
+		return m_failures;
+	}
+};
+
+size_t verify()
+{
+	static const char * levels[] = { "scalar", "SSE2", "AVX2" };
+	size_t failures = 0;
+	for(int level = CPU_SSE2; level <= detect(); level++)
+	{
+		Verifier verifier(levels[level], (CPU_FEATURES)level);
+		failures += verifier.run(4);
+	}
+	return failures;
+}
+
+//выбор ядер при загрузке, чтобы не требовать явной инициализации от пользователей библиотеки
+static struct DSP_INIT
+{
+	DSP_INIT()
+	{
+		init(detect());
+	}
+} dsp_init;
+
+}
+}
+}
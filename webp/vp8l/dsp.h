@@ -0,0 +1,82 @@
+#ifndef DSP_H_
+#define DSP_H_
+#include "../platform.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DSP_X86
+#endif
+
+namespace webp
+{
+namespace vp8l
+{
+
+struct ColorTransformElement;
+
+/*
+ * Ядра прямых и обратных трансформаций над отрезками строк, общие для декодера, кодировщика и оценки стоимости
+ * трансформаций в кодировщике. Для каждого ядра есть скалярная эталонная версия и версии SSE2/AVX2,
+ * нужная выбирается при запуске по CPUID. До выбора(и на платформах без x86) указатели смотрят на скалярные версии
+ */
+namespace dsp
+{
+
+enum CPU_FEATURES
+{
+	CPU_SCALAR	= 0,
+	CPU_SSE2	= 1,
+	CPU_AVX2	= 2
+};
+
+//out[i] = in[i] с прибавленной к красной и синей компонентам зеленой, in и out могут совпадать
+typedef void (*AddGreenToBlueAndRedFunc)(const uint32_t * in, uint32_t * out, const size_t & num_pixels);
+//обратный cross color transform c множителями cte, in и out могут совпадать
+typedef void (*TransformColorInverseFunc)(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels);
+//out[i] = in[i] + предсказание по out[i - 1], top[i - 1], top[i], top[i + 1] одним режимом.
+//out[-1] и top[-1] должны быть доступны, последний пиксель строки(где TR = L) вызывающий обрабатывает сам
+typedef void (*PredictorAddFunc)(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out);
+
+//out[i] = in[i] с вычтенной из красной и синей компонент зеленой, in и out могут совпадать
+typedef void (*SubtractGreenFromBlueAndRedFunc)(const uint32_t * in, uint32_t * out, const size_t & num_pixels);
+//прямой cross color transform c множителями cte, in и out могут совпадать
+typedef void (*TransformColorFunc)(const ColorTransformElement & cte, const uint32_t * in, uint32_t * out, const size_t & num_pixels);
+//out[i] = in[i] - предсказание по in[i - 1], top[i - 1], top[i], top[i + 1] одним режимом, in и out не должны совпадать.
+//in[-1] и top[-1] должны быть доступны, последний пиксель строки(где TR = L) вызывающий обрабатывает сам
+typedef void (*PredictorSubFunc)(const uint32_t * in, const uint32_t * top, const size_t & num_pixels, uint32_t * out);
+
+extern AddGreenToBlueAndRedFunc			AddGreenToBlueAndRed;
+extern TransformColorInverseFunc		TransformColorInverse;
+extern PredictorAddFunc					PredictorAdd[];
+extern SubtractGreenFromBlueAndRedFunc	SubtractGreenFromBlueAndRed;
+extern TransformColorFunc				TransformColor;
+extern PredictorSubFunc					PredictorSub[];
+
+/*
+ * detect
+ * Бросает исключения: нет
+ * Назначение:
+ * определяет по CPUID, какие наборы инструкций поддерживают процессор и ОС
+ */
+CPU_FEATURES detect();
+/*
+ * init
+ * Бросает исключения: нет
+ * Назначение:
+ * выбирает реализации ядер не старше level. Вызывается автоматически при загрузке с detect(),
+ * повторный вызов(например, с CPU_SCALAR для сверки) переключает ядра, пока никто не декодирует
+ */
+void init(const CPU_FEATURES & level);
+/*
+ * verify
+ * Бросает исключения: нет
+ * Назначение:
+ * сверяет ядра каждого уровня, поддерживаемого процессором, со скалярными на случайных данных, печатает
+ * первые расхождения и итог по уровню, возвращает число расхождений. Выбранные init ядра не меняет
+ */
+size_t verify();
+
+}
+}
+}
+
+#endif /* DSP_H_ */
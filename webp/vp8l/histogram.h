@@ -0,0 +1,380 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+#include "../platform.h"
+#include "../utils/thread_pool.h"
+#include "huffman_io.h"
+#include <math.h>
+
+namespace webp
+{
+namespace vp8l
+{
+namespace histogram
+{
+
+//значения c * log2(c) для счетчиков меньше этого берутся из таблицы
+#define HISTOGRAM_LOG_TABLE_SIZE 4096
+//примерная стоимость в битах заголовка кода Хаффмана и одной длины кода в нем
+#define HISTOGRAM_CODE_HEADER_BITS 60.0f
+#define HISTOGRAM_SYMBOL_HEADER_BITS 6.0f
+//на сколько частей делится диапазон энтропии каждой компоненты при группировке гистограмм по энтропии
+#define HISTOGRAM_ENTROPY_PARTITIONS 4
+//больше стольких гистограмм попарное жадное объединение не запускается
+#define HISTOGRAM_GREEDY_MAX 256
+
+/*
+ * SLog2Table
+ * Бросает исключения: нет
+ * Назначение:
+ * таблица c * log2(c) для c < HISTOGRAM_LOG_TABLE_SIZE
+ */
+inline const float * SLog2Table()
+{
+	static const std::vector<float> table = [](){
+		std::vector<float> t(HISTOGRAM_LOG_TABLE_SIZE, 0.0f);
+		for(size_t i = 1; i < t.size(); i++)
+			t[i] = i * log2f(i);
+		return t;
+	}();
+	return &table[0];
+}
+
+/*
+ * SLog2
+ * Бросает исключения: нет
+ * Назначение:
+ * c * log2(c), маленькие значения берутся из таблицы
+ */
+inline float SLog2(const uint32_t & c)
+{
+	if (c < HISTOGRAM_LOG_TABLE_SIZE)
+		return SLog2Table()[c];
+	return c * log2f(c);
+}
+
+/*
+ * Гистограммы 5 кодов Хаффмана мета кода, лежащие подряд в одном массиве, чтобы сложение и подсчет стоимости
+ * проходили по памяти последовательно
+ */
+class Histogram
+{
+private:
+	std::vector<uint32_t>	m_counts;
+	size_t					m_offsets[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE + 1];
+	/*
+	 * PopulationCost
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * примерная стоимость в битах кода Хаффмана и закодированных им символов, a и b складываются поэлементно, b может быть NULL
+	 */
+	static float PopulationCost(const uint32_t * a, const uint32_t * b, const size_t & size)
+	{
+		uint32_t total = 0;
+		uint32_t nonzero = 0;
+		float sum = 0;
+		for(size_t i = 0; i < size; i++)
+		{
+			const uint32_t c = b == NULL ? a[i] : a[i] + b[i];
+			if (c != 0)
+			{
+				total += c;
+				nonzero++;
+				sum += SLog2(c);
+			}
+		}
+		//единственный символ кода декодер читает за 0 бит
+		if (nonzero <= 1)
+			return HISTOGRAM_CODE_HEADER_BITS;
+		return SLog2(total) - sum + nonzero * HISTOGRAM_SYMBOL_HEADER_BITS + HISTOGRAM_CODE_HEADER_BITS;
+	}
+public:
+	Histogram(const uint32_t & color_cache_size = 0)
+	{
+		m_offsets[0] = 0;
+		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
+			m_offsets[i + 1] = m_offsets[i] + huffman_io::AlphabetSize[i] + (i == huffman_io::GREEN ? color_cache_size : 0);
+		m_counts.assign(m_offsets[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE], 0);
+	}
+	uint32_t * alphabet(const size_t & code)
+	{
+		return &m_counts[m_offsets[code]];
+	}
+	const uint32_t * alphabet(const size_t & code) const
+	{
+		return &m_counts[m_offsets[code]];
+	}
+	size_t alphabet_size(const size_t & code) const
+	{
+		return m_offsets[code + 1] - m_offsets[code];
+	}
+	void add_literal(const uint32_t & argb)
+	{
+		++m_counts[m_offsets[huffman_io::GREEN] + ((argb >> 8) & 0xff)];
+		++m_counts[m_offsets[huffman_io::RED] + ((argb >> 16) & 0xff)];
+		++m_counts[m_offsets[huffman_io::BLUE] + (argb & 0xff)];
+		++m_counts[m_offsets[huffman_io::ALPHA] + (argb >> 24)];
+	}
+	void add_copy(const uint32_t & length_symbol, const uint32_t & dist_symbol)
+	{
+		++m_counts[m_offsets[huffman_io::GREEN] + 256 + length_symbol];
+		++m_counts[m_offsets[huffman_io::DIST_PREFIX] + dist_symbol];
+	}
+	void add_cache(const uint32_t & key)
+	{
+		++m_counts[m_offsets[huffman_io::GREEN] + 256 + 24 + key];
+	}
+	void add(const Histogram & h)
+	{
+		uint32_t * dst = &m_counts[0];
+		const uint32_t * src = &h.m_counts[0];
+		for(size_t i = 0; i < m_counts.size(); i++)
+			dst[i] += src[i];
+	}
+	void clear()
+	{
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+	}
+	bool empty() const
+	{
+		for(size_t i = 0; i < m_counts.size(); i++)
+			if (m_counts[i] != 0)
+				return false;
+		return true;
+	}
+	/*
+	 * to_histoarray
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * копирует гистограмму кода code в histoarray для построения дерева Хаффмана
+	 */
+	void to_histoarray(const size_t & code, histoarray & histo) const
+	{
+		histo.realloc(alphabet_size(code));
+		memcpy(&histo[0], alphabet(code), alphabet_size(code) * sizeof(uint32_t));
+	}
+	float cost(const size_t & code) const
+	{
+		return PopulationCost(alphabet(code), NULL, alphabet_size(code));
+	}
+	float cost() const
+	{
+		float ret = 0;
+		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
+			ret += cost(i);
+		return ret;
+	}
+	/*
+	 * cost_of_sum
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * стоимость суммы гистограмм a и b, сама сумма не строится
+	 */
+	static float cost_of_sum(const Histogram & a, const Histogram & b)
+	{
+		float ret = 0;
+		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
+			ret += PopulationCost(a.alphabet(i), b.alphabet(i), a.alphabet_size(i));
+		return ret;
+	}
+	virtual ~Histogram()
+	{
+
+	}
+};
+
+/*
+ * ClusterHistograms
+ * Бросает исключения: нет
+ * Назначение:
+ * объединяет гистограммы тайлов в не более чем max_clusters кластеров так, чтобы суммарная стоимость кодов уменьшалась.
+ * Сначала тайлы группируются по энтропии зеленого, красного и синего и сливаются внутри группы, если это выгодно,
+ * затем оставшиеся кластеры жадно сливаются попарно.
+ * tile_clusters получает номер кластера каждого тайла, пустые тайлы получают кластер предыдущего тайла
+ */
+inline void ClusterHistograms(const std::vector<Histogram> & tiles, const size_t & max_clusters, utils::ThreadPool & pool,
+								std::vector<Histogram> & clusters, std::vector<uint32_t> & tile_clusters)
+{
+	static const size_t BinnedCodes[3] = { huffman_io::GREEN, huffman_io::RED, huffman_io::BLUE };
+	const size_t bins_count = HISTOGRAM_ENTROPY_PARTITIONS * HISTOGRAM_ENTROPY_PARTITIONS * HISTOGRAM_ENTROPY_PARTITIONS;
+	clusters.clear();
+	tile_clusters.assign(tiles.size(), 0);
+
+	std::vector<size_t> used;
+	std::vector<float> tile_costs(tiles.size() * 4, 0.0f);
+	for(size_t i = 0; i < tiles.size(); i++)
+		if (!tiles[i].empty())
+			used.push_back(i);
+	if (used.empty())
+	{
+		clusters.push_back(tiles[0]);
+		return;
+	}
+	pool.parallel_for(used.size(), [&](size_t i){
+		const Histogram & tile = tiles[used[i]];
+		float * costs = &tile_costs[used[i] * 4];
+		for(size_t c = 0; c < 3; c++)
+			costs[c] = tile.cost(BinnedCodes[c]);
+		costs[3] = costs[0] + costs[1] + costs[2] + tile.cost(huffman_io::ALPHA) + tile.cost(huffman_io::DIST_PREFIX);
+	});
+
+	//группировка по энтропии
+	float min_cost[3], max_cost[3];
+	for(size_t c = 0; c < 3; c++)
+	{
+		min_cost[c] = max_cost[c] = tile_costs[used[0] * 4 + c];
+		for(size_t i = 1; i < used.size(); i++)
+		{
+			const float cost = tile_costs[used[i] * 4 + c];
+			if (cost < min_cost[c])
+				min_cost[c] = cost;
+			if (cost > max_cost[c])
+				max_cost[c] = cost;
+		}
+	}
+	std::vector<uint32_t> tile_bins(tiles.size(), 0);
+	for(size_t i = 0; i < used.size(); i++)
+	{
+		uint32_t bin = 0;
+		for(size_t c = 0; c < 3; c++)
+		{
+			const float range = max_cost[c] - min_cost[c];
+			uint32_t part = range == 0 ? 0 : (uint32_t)((tile_costs[used[i] * 4 + c] - min_cost[c]) * HISTOGRAM_ENTROPY_PARTITIONS / range);
+			if (part >= HISTOGRAM_ENTROPY_PARTITIONS)
+				part = HISTOGRAM_ENTROPY_PARTITIONS - 1;
+			bin = bin * HISTOGRAM_ENTROPY_PARTITIONS + part;
+		}
+		tile_bins[used[i]] = bin;
+	}
+
+	std::vector<float> cluster_costs;
+	std::vector<uint32_t> cluster_bins;
+	std::vector<int32_t> bin_heads(bins_count, -1);
+	for(size_t i = 0; i < used.size(); i++)
+	{
+		const size_t tile = used[i];
+		const uint32_t bin = tile_bins[tile];
+		const float tile_cost = tile_costs[tile * 4 + 3];
+		if (bin_heads[bin] >= 0)
+		{
+			const size_t head = bin_heads[bin];
+			const float merged_cost = Histogram::cost_of_sum(clusters[head], tiles[tile]);
+			if (merged_cost < cluster_costs[head] + tile_cost)
+			{
+				clusters[head].add(tiles[tile]);
+				cluster_costs[head] = merged_cost;
+				tile_clusters[tile] = head;
+				continue;
+			}
+		}
+		else
+			bin_heads[bin] = clusters.size();
+		tile_clusters[tile] = clusters.size();
+		clusters.push_back(tiles[tile]);
+		cluster_costs.push_back(tile_cost);
+		cluster_bins.push_back(bin);
+	}
+	//кластеров слишком много для попарного объединения, сливаем каждую группу в один кластер
+	if (clusters.size() > HISTOGRAM_GREEDY_MAX)
+	{
+		std::vector<uint32_t> remap(clusters.size());
+		for(size_t i = 0; i < clusters.size(); i++)
+		{
+			const size_t head = bin_heads[cluster_bins[i]];
+			remap[i] = head;
+			if (head != i)
+				clusters[head].add(clusters[i]);
+		}
+		for(size_t i = 0; i < used.size(); i++)
+			tile_clusters[used[i]] = remap[tile_clusters[used[i]]];
+		for(size_t i = 0; i < clusters.size(); i++)
+			if (remap[i] == i)
+				cluster_costs[i] = clusters[i].cost();
+	}
+
+	//живые кластеры, попарное жадное объединение
+	std::vector<uint32_t> alive;
+	std::vector<uint32_t> remap(clusters.size());
+	for(size_t i = 0; i < clusters.size(); i++)
+	{
+		remap[i] = i;
+		if (clusters.size() <= HISTOGRAM_GREEDY_MAX || bin_heads[cluster_bins[i]] == (int32_t)i)
+			alive.push_back(i);
+	}
+	const size_t n = alive.size();
+	//gains[i * n + j], i < j - изменение стоимости при слиянии кластеров alive[i] и alive[j]
+	std::vector<float> gains(n * n, 0.0f);
+	pool.parallel_for(n, [&](size_t i){
+		for(size_t j = i + 1; j < n; j++)
+			gains[i * n + j] = Histogram::cost_of_sum(clusters[alive[i]], clusters[alive[j]])
+								- cluster_costs[alive[i]] - cluster_costs[alive[j]];
+	});
+	std::vector<bool> merged(n, false);
+	size_t alive_count = n;
+	while(alive_count > 1)
+	{
+		size_t best_i = 0, best_j = 0;
+		float best_gain = 0;
+		bool found = false;
+		for(size_t i = 0; i < n; i++)
+		{
+			if (merged[i])
+				continue;
+			for(size_t j = i + 1; j < n; j++)
+				if (!merged[j] && (!found || gains[i * n + j] < best_gain))
+				{
+					best_gain = gains[i * n + j];
+					best_i = i;
+					best_j = j;
+					found = true;
+				}
+		}
+		if (best_gain >= 0 && alive_count <= max_clusters)
+			break;
+		clusters[alive[best_i]].add(clusters[alive[best_j]]);
+		cluster_costs[alive[best_i]] += cluster_costs[alive[best_j]] + best_gain;
+		remap[alive[best_j]] = alive[best_i];
+		merged[best_j] = true;
+		alive_count--;
+		pool.parallel_for(n, [&](size_t k){
+			if (merged[k] || k == best_i)
+				return;
+			const size_t i = k < best_i ? k : best_i;
+			const size_t j = k < best_i ? best_i : k;
+			gains[i * n + j] = Histogram::cost_of_sum(clusters[alive[i]], clusters[alive[j]])
+								- cluster_costs[alive[i]] - cluster_costs[alive[j]];
+		});
+	}
+
+	//нумеруем оставшиеся кластеры подряд
+	std::vector<uint32_t> index(clusters.size(), 0);
+	std::vector<Histogram> result;
+	for(size_t i = 0; i < n; i++)
+		if (!merged[i])
+		{
+			index[alive[i]] = result.size();
+			result.push_back(clusters[alive[i]]);
+		}
+	for(size_t i = 0; i < clusters.size(); i++)
+	{
+		size_t root = i;
+		while(remap[root] != root)
+			root = remap[root];
+		index[i] = index[root];
+	}
+	clusters.swap(result);
+	uint32_t previous = 0;
+	for(size_t i = 0; i < tiles.size(); i++)
+	{
+		if (tiles[i].empty())
+			tile_clusters[i] = previous;
+		else
+			tile_clusters[i] = index[tile_clusters[i]];
+		previous = tile_clusters[i];
+	}
+}
+
+}
+}
+}
+
+#endif /* HISTOGRAM_H_ */
@@ -35,6 +35,8 @@ enum MetaHuffmanCode
 };
 
 #define MAX_ALLOWED_CODE_LENGTH      64
+//энкодер ограничивает длину кода, как формат VP8L, чтобы коды декодировались одной таблицей HuffmanTable
+#define MAX_ENCODER_CODE_LENGTH      15
 
 #define NON_ZERO_REPS_CODE		MAX_ALLOWED_CODE_LENGTH + 1
 #define ZERO_11_REPS_CODE 		MAX_ALLOWED_CODE_LENGTH + 2
@@ -75,25 +77,12 @@ class VP8_LOSSLESS_HUFFMAN
 {
 private:
 	utils::BitReader*		m_bit_reader;
-	//webp::huffman::dec::HuffmanTree*	m_huffman_trees[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE];
-	std::vector<webp::huffman_coding::dec::HuffmanTree>	m_huffman_trees;
-	VP8_LOSSLESS_HUFFMAN()
-		: m_bit_reader(NULL)
-	{
-
-	}
-	int read_symbol(const webp::huffman_coding::dec::HuffmanTree& tree) const
-	{
-		webp::huffman_coding::dec::HuffmanTree::iterator iter = tree.root();
-		while(!(*iter).is_leaf())
-			iter.next(m_bit_reader->ReadBits(1));
-		return (*iter).symbol();
-	}
+	std::vector<webp::huffman_coding::dec::HuffmanTable>	m_huffman_tables;
 	void read_code_length(const utils::array<code_length_t> & code_length_code_lengths, const size_t & num_symbols, utils::array<code_length_t> & code_lengths)
 	{
 		symbol_t symbol;
 		symbol_t max_symbol;
-		webp::huffman_coding::dec::HuffmanTree tree(code_length_code_lengths);
+		webp::huffman_coding::dec::HuffmanTable table(code_length_code_lengths);
 
 		////////////////////////////////////////////////////
 		//Незадокументированный кусок кода, копипаст из libwebp
@@ -117,7 +106,7 @@ private:
 			code_length_t code_len;
 			if (max_symbol-- == 0)
 				break;
-			code_len = read_symbol(tree);
+			code_len = table.read_symbol(*m_bit_reader);
 			if (code_len < NON_ZERO_REPS_CODE)
 			{
 				code_lengths[symbol++] = code_len;
@@ -144,8 +133,12 @@ private:
 			}
 		}
 	}
-	void read_code(const uint32_t & alphabet_size)
+	//читает код index, таблица строится заново, если ее еще нет, иначе перестраивается на месте
+	void read_code(const uint32_t & index, const uint32_t & alphabet_size)
 	{
+		if (m_huffman_tables.size() <= index)
+			m_huffman_tables.resize(index + 1);
+		webp::huffman_coding::dec::HuffmanTable & table = m_huffman_tables[index];
 		//Simple code length или Normal code length
 		uint32_t is_simple_code = m_bit_reader->ReadBits(1);
 
@@ -173,8 +166,8 @@ private:
 				codes[1] = 1;
 				code_lengths[1] = num_symbols - 1;
 			}
-			//строим дерево Хаффмана
-			m_huffman_trees.push_back(webp::huffman_coding::dec::HuffmanTree(code_lengths, codes, symbols, alphabet_size, num_symbols));
+			//строим таблицу Хаффмана
+			table.init(code_lengths, codes, symbols, alphabet_size, num_symbols);
 		}
 		else
 		{
@@ -190,27 +183,44 @@ private:
 				code_length_code_lengths[kCodeLengthCodeOrder[i]] = m_bit_reader->ReadBits(BITS_COUNT_FOR_RLE_CODE_LENGTHS);
 
 			read_code_length(code_length_code_lengths, alphabet_size, code_lengths);
-			m_huffman_trees.push_back(webp::huffman_coding::dec::HuffmanTree(code_lengths));
+			table.init(code_lengths);
 		}
 	}
 public:
+	//пустой набор, коды читаются вызовом read
+	VP8_LOSSLESS_HUFFMAN()
+		: m_bit_reader(NULL)
+	{
+
+	}
 	/*
 	 * Исключение: InvalidHuffman
 	 */
 	VP8_LOSSLESS_HUFFMAN(utils::BitReader * bit_reader, const uint32_t & color_cache_size)
-		: m_bit_reader(bit_reader)
+		: m_bit_reader(NULL)
+	{
+		read(bit_reader, color_cache_size);
+	}
+	/*
+	 * read
+	 * Бросает исключения: InvalidHuffman
+	 * Назначение:
+	 * читает 5 кодов Хаффмана, таблицы от предыдущего чтения переиспользуются
+	 */
+	void read(utils::BitReader * bit_reader, const uint32_t & color_cache_size)
 	{
+		m_bit_reader = bit_reader;
 		for(uint32_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
 		{
 			uint32_t alphabet_size = AlphabetSize[i];
 			if (i == 0)
 				alphabet_size += color_cache_size;
-			read_code(alphabet_size);
+			read_code(i, alphabet_size);
 		}
 	}
 	int32_t read_symbol(const MetaHuffmanCode & mhc) const
 	{
-		return read_symbol(m_huffman_trees[mhc]);
+		return m_huffman_tables[mhc].read_symbol(*m_bit_reader);
 	}
 	virtual ~VP8_LOSSLESS_HUFFMAN()
 	{
@@ -360,7 +370,9 @@ private:
 		for(size_t i = 0; i < rle_sequence.size(); i++){
 			uint16_t sequence_element = rle_sequence.code_length(i);
 			uint8_t extra_bits = rle_sequence.extra_bits(i);
-			m_bit_writer->WriteBits(tree_of_rle_sequence.get_codes()[sequence_element], tree_of_rle_sequence.get_lengths()[sequence_element]);
+			//если символ один, декодер читает его за 0 бит
+			if (tree_of_rle_sequence.get_num_nodes() > 1)
+				m_bit_writer->WriteBits(tree_of_rle_sequence.get_codes()[sequence_element], tree_of_rle_sequence.get_lengths()[sequence_element]);
 			if (sequence_element == NON_ZERO_REPS_CODE)
 				m_bit_writer->WriteBits(extra_bits, 2);
 			if (sequence_element == ZERO_11_REPS_CODE)
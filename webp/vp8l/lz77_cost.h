@@ -0,0 +1,109 @@
+#ifndef LZ77_COST_H_
+#define LZ77_COST_H_
+#include "../platform.h"
+#include "../lz77/lz77.h"
+#include "histogram.h"
+#include "color_cache.h"
+#include <math.h>
+
+namespace webp
+{
+namespace vp8l
+{
+
+/*
+ * Оценка стоимости в битах токенов LZ77 для оптимального разбора(см. LZ77::optimize).
+ * Стоимость символа - -log2 его частоты в гистограмме первого прохода, копия платит еще и за экстра биты длины и
+ * смещения. Литерал, который декодер найдет в цветовом кэше, стоит как ссылка на кэш: попадания в кэш не зависят от
+ * разбора, потому что в кэш попадает каждый пиксель, поэтому они считаются заранее
+ */
+class LZ77CostModel
+{
+private:
+	const uint32_t *		m_data;
+	uint32_t				m_cache_bits;
+	std::vector<bool>		m_cache_hits;
+	std::vector<float>		m_literal[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE];
+	//стоимость длины копии по самой длине, экстра биты включены
+	std::vector<float>		m_length;
+	/*
+	 * SymbolCosts
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * -log2 частоты символов. Символы, которых не было, считаются вдвое реже самого редкого возможного,
+	 * если же алфавит не использовался вовсе, все символы равновероятны
+	 */
+	static void SymbolCosts(const uint32_t * counts, const size_t & size, std::vector<float> & costs)
+	{
+		uint32_t total = 0;
+		for(size_t i = 0; i < size; i++)
+			total += counts[i];
+		costs.resize(size);
+		if (total == 0)
+		{
+			std::fill(costs.begin(), costs.end(), log2f(size));
+			return;
+		}
+		const float log2_total = log2f(total);
+		for(size_t i = 0; i < size; i++)
+			costs[i] = counts[i] == 0 ? log2_total + 1.0f : log2_total - log2f(counts[i]);
+	}
+	static float PrefixCost(const std::vector<float> & symbol_costs, const uint32_t & value)
+	{
+		uint16_t symbol;
+		size_t extra_bits_count, extra_bits_value;
+		lz77::prefix_coding_encode(value, symbol, extra_bits_count, extra_bits_value);
+		return symbol_costs[symbol] + extra_bits_count;
+	}
+public:
+	/*
+	 * LZ77CostModel
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * histo - гистограмма токенов первого прохода по data, в которых уже стоят ссылки на кэш размера 1 << cache_bits,
+	 * max_length - наибольшая длина копии
+	 */
+	LZ77CostModel(const histogram::Histogram & histo, const utils::pixel_array & data, const uint32_t & cache_bits,
+					const uint32_t & max_length)
+		: m_data(&data[0]), m_cache_bits(cache_bits)
+	{
+		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
+			SymbolCosts(histo.alphabet(i), histo.alphabet_size(i), m_literal[i]);
+		std::vector<float> length_symbols(m_literal[huffman_io::GREEN].begin() + 256,
+											m_literal[huffman_io::GREEN].begin() + 256 + 24);
+		m_length.resize(max_length + 1, 0.0f);
+		for(uint32_t length = 1; length <= max_length; length++)
+			m_length[length] = PrefixCost(length_symbols, length);
+		if (cache_bits == 0)
+			return;
+		VP8_LOSSLESS_COLOR_CACHE color_cache(cache_bits);
+		m_cache_hits.resize(data.size());
+		for(size_t i = 0; i < data.size(); i++)
+		{
+			m_cache_hits[i] = color_cache.get(color_cache.key(data[i])) == data[i];
+			color_cache.insert(data[i]);
+		}
+	}
+	float literal(const uint32_t & pos) const
+	{
+		const uint32_t argb = m_data[pos];
+		//ключ как в VP8_LOSSLESS_COLOR_CACHE::key
+		if (m_cache_bits != 0 && m_cache_hits[pos])
+			return m_literal[huffman_io::GREEN][256 + 24 + ((0x1e35a7bd * argb) >> (32 - m_cache_bits))];
+		return m_literal[huffman_io::GREEN][(argb >> 8) & 0xff] + m_literal[huffman_io::RED][(argb >> 16) & 0xff] +
+				m_literal[huffman_io::BLUE][argb & 0xff] + m_literal[huffman_io::ALPHA][argb >> 24];
+	}
+	float length(const uint32_t & length) const
+	{
+		return m_length[length];
+	}
+	float distance(const uint32_t & dist_code) const
+	{
+		return PrefixCost(m_literal[huffman_io::DIST_PREFIX], dist_code);
+	}
+};
+
+}
+}
+
+#endif /* LZ77_COST_H_ */
@@ -0,0 +1,118 @@
+#ifndef PALETTE_H_
+#define PALETTE_H_
+#include "../platform.h"
+#include "../utils/utils.h"
+#include <algorithm>
+
+#define PALLETE_MAX_COLORS 256
+//размер хэш-таблицы цветов с запасом в 4 раза, чтобы цепочки проб были короткими
+#define PALETTE_HASH_BITS 10
+
+namespace webp
+{
+namespace vp8l
+{
+
+/*
+ * Хэш-таблица цветов палитры с открытой адресацией и линейным пробированием.
+ * Собирает различные цвета изображения, прекращая проход, как только их больше PALLETE_MAX_COLORS,
+ * а после сортировки палитры отдает индекс цвета за O(1)
+ */
+class PaletteHash
+{
+private:
+	uint32_t				m_colors[1 << PALETTE_HASH_BITS];
+	//индекс цвета в палитре + 1, 0 - ячейка пуста
+	uint16_t				m_slots[1 << PALETTE_HASH_BITS];
+	size_t					m_size;
+	static uint32_t hash(const uint32_t & color)
+	{
+		return (0x1e35a7bd * color) >> (32 - PALETTE_HASH_BITS);
+	}
+	size_t find(const uint32_t & color) const
+	{
+		size_t slot = hash(color);
+		while(m_slots[slot] != 0 && m_colors[slot] != color)
+			slot = (slot + 1) & ((1 << PALETTE_HASH_BITS) - 1);
+		return slot;
+	}
+public:
+	PaletteHash()
+		: m_size(0)
+	{
+		memset(m_slots, 0, sizeof(m_slots));
+	}
+	/*
+	 * build
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * собирает различные цвета изображения, возвращает false, если их больше PALLETE_MAX_COLORS.
+	 * Одинаковые соседние пиксели в таблицу не идут
+	 */
+	bool build(const utils::pixel_array & argb_image)
+	{
+		if (argb_image.size() == 0)
+			return true;
+		uint32_t last = ~argb_image[0];
+		for(size_t i = 0; i < argb_image.size(); i++)
+		{
+			const uint32_t color = argb_image[i];
+			if (color == last)
+				continue;
+			last = color;
+			const size_t slot = find(color);
+			if (m_slots[slot] != 0)
+				continue;
+			if (m_size == PALLETE_MAX_COLORS)
+			{
+				clear();
+				return false;
+			}
+			m_colors[slot] = color;
+			m_slots[slot] = ++m_size;
+		}
+		return true;
+	}
+	void clear()
+	{
+		memset(m_slots, 0, sizeof(m_slots));
+		m_size = 0;
+	}
+	const size_t & size() const
+	{
+		return m_size;
+	}
+	/*
+	 * sorted
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * пишет палитру в palette по возрастанию цветов и перенумеровывает цвета в таблице в этом порядке, см. index
+	 */
+	void sorted(utils::pixel_array & palette)
+	{
+		palette.realloc(m_size);
+		size_t count = 0;
+		for(size_t slot = 0; slot < (1 << PALETTE_HASH_BITS); slot++)
+			if (m_slots[slot] != 0)
+				palette[count++] = m_colors[slot];
+		std::sort(&palette[0], &palette[0] + count);
+		for(size_t slot = 0; slot < (1 << PALETTE_HASH_BITS); slot++)
+			if (m_slots[slot] != 0)
+				m_slots[slot] = std::lower_bound(&palette[0], &palette[0] + count, m_colors[slot]) - &palette[0] + 1;
+	}
+	/*
+	 * index
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * индекс цвета в палитре после sorted, цвет должен быть в таблице
+	 */
+	uint8_t index(const uint32_t & color) const
+	{
+		return m_slots[find(color)] - 1;
+	}
+};
+
+}
+}
+
+#endif /* PALETTE_H_ */
@@ -0,0 +1,154 @@
+#ifndef STATS_H_
+#define STATS_H_
+#include "../platform.h"
+#include <chrono>
+
+namespace webp
+{
+namespace vp8l
+{
+
+/*
+ * Verbose
+ * Бросает исключения: нет
+ * Назначение:
+ * включает сообщения кодировщика о ходе работы в stdout, по умолчанию они выключены
+ */
+inline bool & Verbose()
+{
+	static bool verbose = false;
+	return verbose;
+}
+
+#define VP8L_LOG(...) do { if (webp::vp8l::Verbose()) printf(__VA_ARGS__); } while(0)
+
+/*
+ * Статистика кодирования/декодирования одного изображения. Заполняется кодировщиком и декодером, если им передан
+ * указатель на нее: время стадий, размеры частей потока, счетчики токенов LZ77 и кодов Хаффмана основного изображения
+ */
+struct Stats
+{
+	struct stage_t
+	{
+		std::string		name;
+		double			seconds;
+	};
+	//стадии в порядке первого появления, время повторных вызовов стадии складывается
+	std::vector<stage_t>	stages;
+	//бит потока под данные трансформаций, entropy image и основное изображение(вместе с его кодами Хаффмана)
+	uint64_t				transform_bits;
+	uint64_t				entropy_image_bits;
+	uint64_t				main_image_bits;
+	//токены основного изображения
+	uint64_t				literals;
+	uint64_t				copies;
+	uint64_t				cache_hits;
+	uint64_t				copied_pixels;
+	//коды Хаффмана основного изображения и бит на их длины
+	uint64_t				huffman_codes;
+	uint64_t				huffman_header_bits;
+	Stats()
+	{
+		clear();
+	}
+	void clear()
+	{
+		stages.clear();
+		transform_bits = entropy_image_bits = main_image_bits = 0;
+		literals = copies = cache_hits = copied_pixels = 0;
+		huffman_codes = huffman_header_bits = 0;
+	}
+	void add_stage(const std::string & name, const double & seconds)
+	{
+		for(size_t i = 0; i < stages.size(); i++)
+			if (stages[i].name == name)
+			{
+				stages[i].seconds += seconds;
+				return;
+			}
+		stage_t stage = { name, seconds };
+		stages.push_back(stage);
+	}
+	double average_match_length() const
+	{
+		return copies == 0 ? 0.0 : (double)copied_pixels / copies;
+	}
+	/*
+	 * json
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * статистика одним объектом JSON, время в миллисекундах, размеры в байтах
+	 */
+	std::string json() const
+	{
+		std::string out = "{\n\t\"stages_ms\": {";
+		char buf[256];
+		for(size_t i = 0; i < stages.size(); i++)
+		{
+			snprintf(buf, sizeof(buf), "%s\n\t\t\"%s\": %.3f", i == 0 ? "" : ",", stages[i].name.c_str(), stages[i].seconds * 1e3);
+			out += buf;
+		}
+		snprintf(buf, sizeof(buf), "\n\t},\n\t\"bytes\": {\n\t\t\"transforms\": %llu,\n\t\t\"entropy_image\": %llu,\n\t\t\"main_image\": %llu\n\t},\n",
+					(unsigned long long)((transform_bits + 7) >> 3), (unsigned long long)((entropy_image_bits + 7) >> 3),
+					(unsigned long long)((main_image_bits + 7) >> 3));
+		out += buf;
+		snprintf(buf, sizeof(buf), "\t\"tokens\": {\n\t\t\"literals\": %llu,\n\t\t\"copies\": %llu,\n\t\t\"cache_hits\": %llu,\n"
+									"\t\t\"average_match_length\": %.2f\n\t},\n",
+					(unsigned long long)literals, (unsigned long long)copies, (unsigned long long)cache_hits, average_match_length());
+		out += buf;
+		snprintf(buf, sizeof(buf), "\t\"huffman\": {\n\t\t\"codes\": %llu,\n\t\t\"header_bytes\": %llu\n\t}\n}\n",
+					(unsigned long long)huffman_codes, (unsigned long long)((huffman_header_bits + 7) >> 3));
+		out += buf;
+		return out;
+	}
+};
+
+/*
+ * Замеряет время от создания до stop() или разрушения и добавляет его в stats как стадию name.
+ * Если stats == NULL, ничего не делает и часы не читает
+ */
+class StageTimer
+{
+private:
+	Stats *									m_stats;
+	const char *							m_name;
+	std::chrono::steady_clock::time_point	m_start;
+	double									m_excluded;
+	StageTimer(const StageTimer &);
+	StageTimer & operator=(const StageTimer &);
+public:
+	StageTimer(Stats * stats, const char * name)
+		: m_stats(stats), m_name(name), m_excluded(0.0)
+	{
+		if (m_stats != NULL)
+			m_start = std::chrono::steady_clock::now();
+	}
+	//возвращает замеренное время в секундах, повторный вызов возвращает 0
+	double stop()
+	{
+		if (m_stats == NULL)
+			return 0.0;
+		const double seconds = elapsed() - m_excluded;
+		m_stats->add_stage(m_name, seconds);
+		m_stats = NULL;
+		return seconds;
+	}
+	//время вложенной стадии, которое не должно попасть в эту
+	void exclude(const double & seconds)
+	{
+		m_excluded += seconds;
+	}
+	double elapsed() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	}
+	virtual ~StageTimer()
+	{
+		stop();
+	}
+};
+
+}
+}
+
+#endif /* STATS_H_ */
@@ -85,6 +85,42 @@ uint32_t ClampAddSubtractHalf(const uint32_t & a, const uint32_t & b)
 	return ret;
 }
 
+uint32_t Predict(const uint32_t & mode, const uint32_t & L, const uint32_t & T, const uint32_t & TR, const uint32_t & TL)
+{
+	switch (mode) {
+		case 0:
+			return 0xff000000;
+		case 1:
+			return L;
+		case 2:
+			return T;
+		case 3:
+			return TR;
+		case 4:
+			return TL;
+		case 5:
+			return Average2(Average2(L, TR), T);
+		case 6:
+			return Average2(L, TL);
+		case 7:
+			return Average2(L, T);
+		case 8:
+			return Average2(TL, T);
+		case 9:
+			return Average2(T, TR);
+		case 10:
+			return Average2(Average2(L, TL), Average2(T, TR));
+		case 11:
+			//Select(top[0], left, top[-1]);
+			return Select(T, L, TL);//Select(L, T, TL); - косяк документации?
+		case 12:
+			return ClampAddSubtractFull(L, T, TL);
+		case 13:
+			return ClampAddSubtractHalf(Average2(L, T), TL);
+	}
+	return 0xff000000;
+}
+
 void BundleColorMap(const uint8_t* const row, int width,
                            int xbits, uint32_t* const dst) {
   int x;
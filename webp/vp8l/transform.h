@@ -3,6 +3,7 @@
 #include "../platform.h"
 #include "../exception/exception.h"
 #include "../utils/utils.h"
+#include "dsp.h"
 
 
 #define DIV_ROUND_UP(num, den) ((num) + (den) - 1) / (den)
@@ -21,6 +22,15 @@ uint32_t ClampAddSubtractFull(const uint32_t & a, const uint32_t & b, const uint
 uint32_t ClampAddSubtractHalf(const uint32_t & a, const uint32_t & b);
 void BundleColorMap(const uint8_t* const row, int width,  int xbits, uint32_t* const dst);
 
+#define PREDICTOR_MODES_COUNT 14
+/*
+ * Predict
+ * Бросает исключения: нет
+ * Назначение:
+ * предсказание пикселя режимом mode(0..13) по соседям слева, сверху, сверху справа и сверху слева
+ */
+uint32_t Predict(const uint32_t & mode, const uint32_t & L, const uint32_t & T, const uint32_t & TR, const uint32_t & TL);
+
 struct ColorTransformElement
 {
 	uint8_t green_to_red;
@@ -34,6 +44,17 @@ struct ColorTransformElement
 	}
 };
 
+/*
+ * ColorTransformDelta
+ * Бросает исключения: нет
+ * Назначение:
+ * поправка компоненты цвета cross color transform: произведение множителя t и компоненты c, деленное на 32
+ */
+inline int8_t ColorTransformDelta(const int8_t & t, const int8_t & c)
+{
+	return (t * c) >> 5;
+}
+
 class VP8_LOSSLESS_TRANSFORM
 {
 public:
@@ -50,171 +71,125 @@ private:
 	uint32_t				m_ysize;
 	uint32_t				m_bits;
 	utils::pixel_array	m_data;
-	/*
-		 * InverseColorIndexingTransform
+	//предыдущая восстановленная строка, нужна predictor transform
+	utils::pixel_array	m_prev_row;
+		/*
+		 * InverseColorIndexingRows
 		 * Бросает исключения: нет
 		 * Назначение:
-		 * инвертирует color indexing tranform если имеется
+		 * заменяет индексы строк цветами палитры, в одном пикселе in может быть упаковано несколько индексов
 		 */
-		void InverseColorIndexingTransform(utils::pixel_array & argb_image, const uint32_t & image_width, const uint32_t & image_height)
+		void InverseColorIndexingRows(const uint32_t * in, const size_t & in_stride, uint32_t * out, const size_t & out_stride,
+										const uint32_t & rows, const uint32_t & image_width)
 		{
-			//в argb_image находятся индексы, скопируем их, т.к в argb_image будем формировать конечное изображение
-			utils::pixel_array indices = argb_image;
-			//кол-во пикселей(по сути индексов) в одном байте indices
-			size_t pixels_per_byte = 1 << m_bits;
+			//кол-во пикселей(по сути индексов) в одном байте
+			const size_t pixels_per_byte = 1 << m_bits;
 			//сколько бит приходится на один пиксель(индекс)
-			size_t bits_per_pixel = 8 >> m_bits;
-			size_t mask = (1 << bits_per_pixel) - 1;
-			uint32_t color_indexing_xsize = DIV_ROUND_UP(image_width, 1 << m_bits);
-			//пробегаемся по всем строкам
-			for(size_t y = 0; y < image_height; y++)
-			{
-				//берем указатель на строку в конечном изображении
-				uint32_t * row_iter = &argb_image[y * image_width];
-				//пробегаемся по всем пикселям indices
-				for(size_t x = 0; x < color_indexing_xsize; x++)
-					//пробегаемся по всем индексам в зеленом байте пикселя из indices
-					for(size_t i = 0; i < pixels_per_byte; i++)
-					{
-						//вытаскиваем индекс
-						uint32_t color_table_index = (*utils::GREEN(indices[y * color_indexing_xsize + x]) >> (i * bits_per_pixel)) & mask;
-						//вытаскиваем цвет из палитры по индексу
-						*row_iter = m_data[color_table_index];
-						//сдвигаемся к следущему пикселю в строке
-						row_iter++;
-					}
-			}
+			const size_t bits_per_pixel = 8 >> m_bits;
+			const size_t mask = (1 << bits_per_pixel) - 1;
+			const uint32_t palette_size = m_data.size();
+			for(uint32_t r = 0; r < rows; r++, in += in_stride, out += out_stride)
+				for(size_t x = 0; x < image_width; x++)
+				{
+					const uint32_t packed = *utils::GREEN(in[x >> m_bits]);
+					const uint32_t color_table_index = (packed >> ((x & (pixels_per_byte - 1)) * bits_per_pixel)) & mask;
+					//индексы за пределами палитры дают нулевой цвет
+					out[x] = color_table_index < palette_size ? m_data[color_table_index] : 0;
+				}
 		}
 		/*
-		 * InverseSubstractGreenTransform
+		 * InverseSubstractGreenRows
 		 * Бросает исключения: нет
 		 * Назначение:
-		 * инвертирует subtract green tranform если имеется
+		 * инвертирует subtract green tranform для строк
 		 */
-		void InverseSubstractGreenTransform(utils::pixel_array & argb_image, const uint32_t & image_width, const uint32_t & image_height)
+		void InverseSubstractGreenRows(const uint32_t * in, const size_t & in_stride, uint32_t * out, const size_t & out_stride,
+										const uint32_t & rows, const uint32_t & image_width)
 		{
-			for(size_t y = 0; y < image_height; y++)
-				for(size_t x = 0; x < image_width; x++)
-				{
-					uint32_t i = y * image_width + x;
-					*utils::RED(argb_image[i])  = (*utils::RED(argb_image[i])  + *utils::GREEN(argb_image[i])) & 0xff;
-					*utils::BLUE(argb_image[i]) = (*utils::BLUE(argb_image[i]) + *utils::GREEN(argb_image[i])) & 0xff;
-				}
+			for(uint32_t r = 0; r < rows; r++, in += in_stride, out += out_stride)
+				dsp::AddGreenToBlueAndRed(in, out, image_width);
 		}
 		/*
-		 * InversePredictorTransform
-		 * Бросает исключения: нет
+		 * InversePredictorRows
+		 * Бросает исключения: InvalidVP8L
 		 * Назначение:
-		 * инвертирует subtract green tranform если имеется
+		 * инвертирует predictor transform для строк [y, y + rows). Соседи сверху для первой строки берутся из m_prev_row,
+		 * для остальных - из уже восстановленной строки out выше. Режим читается один раз на блок
 		 */
-		void InversePredictorTransform(utils::pixel_array & argb_image, const uint32_t & image_width, const uint32_t & image_height)
+		void InversePredictorRows(const uint32_t * in, const size_t & in_stride, uint32_t * out, const size_t & out_stride,
+									const uint32_t & y, const uint32_t & rows, const uint32_t & image_width)
 		{
-			for(size_t y = 0; y < image_height; y++)
-				for(size_t x = 0; x < image_width; x++)
+			const uint32_t block_size = 1 << m_bits;
+			for(uint32_t r = 0; r < rows; r++, in += in_stride, out += out_stride)
+			{
+				const uint32_t row_y = y + r;
+				if (row_y == 0)
 				{
-					size_t i = y * image_width + x;
-					uint32_t P;//&argb_image[i];
-					if (x == 0 && y == 0)
-					{
-						P = 0xff000000;
-						PixelsSum(&argb_image[i], P);
-						continue;
-					}
-					if (x == 0)
-					{
-						P = argb_image[i - image_width];
-						PixelsSum(&argb_image[i], P);
-						continue;
-					}
-					if (y == 0)
+					//первая строка: первый пиксель предсказывается черным, остальные - левым
+					uint32_t P = 0xff000000;
+					for(size_t x = 0; x < image_width; x++)
 					{
-						P = argb_image[i - 1];
-						PixelsSum(&argb_image[i], P);
-						continue;
-					}
-					uint32_t L = argb_image[i - 1];
-					uint32_t T = argb_image[i - image_width];
-					uint32_t TR = (x == image_width - 1) ? L : argb_image[i - image_width + 1];
-					uint32_t TL = argb_image[i - image_width - 1];
-					int block_index = (y >> m_bits) * m_xsize + (x >> m_bits);
-					uint32_t mode = *utils::GREEN(m_data[block_index]);
-					switch (mode) {
-						case 0:
-							P = 0xff000000;
-							break;
-						case 1:
-							P = L;
-							break;
-						case 2:
-							P = T;
-							break;
-						case 3:
-							P = TR;
-							break;
-						case 4:
-							P = TL;
-							break;
-						case 5:
-							P = Average2(Average2(L, TR), T);
-							break;
-						case 6:
-							P = Average2(L, TL);
-							break;
-						case 7:
-							P = Average2(L, T);
-							break;
-						case 8:
-							P = Average2(TL, T);
-							break;
-						case 9:
-							P = Average2(T, TR);
-							break;
-						case 10:
-							P = Average2(Average2(L, TL), Average2(T, TR));
-							break;
-						case 11:
-							//Select(top[0], left, top[-1]);
-							P = Select(T, L, TL);//Select(L, T, TL); - косяк документации?
-							break;
-						case 12:
-							P = ClampAddSubtractFull(L, T, TL);
-							break;
-						case 13:
-							P = ClampAddSubtractHalf(Average2(L, T), TL);
-							break;
-						default:
-							throw exception::InvalidVP8L();
-							break;
+						uint32_t argb = in[x];
+						PixelsSum(&argb, P);
+						out[x] = P = argb;
 					}
-					PixelsSum(&argb_image[i], P);
+					continue;
 				}
+				const uint32_t * top = r == 0 ? &m_prev_row[0] : out - out_stride;
+				uint32_t argb = in[0];
+				PixelsSum(&argb, top[0]);
+				out[0] = argb;
+				const uint32_t * modes = &m_data[(row_y >> m_bits) * m_xsize];
+				//у последнего пикселя строки нет соседа сверху справа, он восстанавливается отдельно
+				const uint32_t last = image_width - 1;
+				for(uint32_t x = 1; x < last;)
+				{
+					const uint32_t mode = *utils::GREEN(modes[x >> m_bits]);
+					if (mode >= PREDICTOR_MODES_COUNT)
+						throw exception::InvalidVP8L();
+					uint32_t block_end = ((x >> m_bits) + 1) * block_size;
+					if (block_end > last)
+						block_end = last;
+					dsp::PredictorAdd[mode](in + x, top + x, block_end - x, out + x);
+					x = block_end;
+				}
+				if (last != 0)
+				{
+					const uint32_t mode = *utils::GREEN(modes[last >> m_bits]);
+					if (mode >= PREDICTOR_MODES_COUNT)
+						throw exception::InvalidVP8L();
+					const uint32_t L = out[last - 1];
+					argb = in[last];
+					PixelsSum(&argb, Predict(mode, L, top[last], L, top[last - 1]));
+					out[last] = argb;
+				}
+			}
+			//верхние соседи для следующего вызова
+			memcpy(&m_prev_row[0], out - out_stride, image_width * sizeof(uint32_t));
 		}
-		int8_t ColorTransformDelta(int8_t t, int8_t c)
-		{
-			return (t * c) >> 5;
-		}
-		void InverseColorTransform(utils::pixel_array & argb_image, const uint32_t & image_width, const uint32_t & image_height)
+		/*
+		 * InverseColorRows
+		 * Бросает исключения: нет
+		 * Назначение:
+		 * инвертирует cross color transform для строк [y, y + rows), множители читаются один раз на блок
+		 */
+		void InverseColorRows(const uint32_t * in, const size_t & in_stride, uint32_t * out, const size_t & out_stride,
+								const uint32_t & y, const uint32_t & rows, const uint32_t & image_width)
 		{
-			for(size_t y = 0; y < image_height; y++)
-				for(size_t x = 0; x < image_width; x++)
+			const uint32_t block_size = 1 << m_bits;
+			for(uint32_t r = 0; r < rows; r++, in += in_stride, out += out_stride)
+			{
+				const uint32_t * elements = &m_data[((y + r) >> m_bits) * m_xsize];
+				for(uint32_t x = 0; x < image_width;)
 				{
-					size_t i = y * image_width + x;
-					int block_index = (y >> m_bits) * m_xsize + (x >> m_bits);
-					uint32_t data = m_data[block_index];
-					ColorTransformElement cte(data);
-
-					uint8_t red = *utils::RED(argb_image[i]);
-					uint8_t green = *utils::GREEN(argb_image[i]);
-					uint8_t blue = *utils::BLUE(argb_image[i]);
-
-					//еще один косяк документации, в написано, что надо вычитать
-					red  += ColorTransformDelta(cte.green_to_red,  green);
-					blue += ColorTransformDelta(cte.green_to_blue, green);
-					blue += ColorTransformDelta(cte.red_to_blue, red & 0xff);
-
-					*utils::RED(argb_image[i]) = red & 0xff;
-					*utils::BLUE(argb_image[i]) = blue & 0xff;
+					const ColorTransformElement cte(elements[x >> m_bits]);
+					uint32_t block_end = ((x >> m_bits) + 1) * block_size;
+					if (block_end > image_width)
+						block_end = image_width;
+					dsp::TransformColorInverse(cte, in + x, out + x, block_end - x);
+					x = block_end;
 				}
+			}
 		}
 public:
 	VP8_LOSSLESS_TRANSFORM()
@@ -262,16 +237,38 @@ public:
 	{
 		return m_data.size();
 	}
-	void inverse(utils::pixel_array & argb_image, const uint32_t & image_width, const uint32_t & image_height)
+	/*
+	 * inverse_rows
+	 * Бросает исключения: InvalidVP8L
+	 * Назначение:
+	 * инвертирует трансформацию для строк [y, y + rows) изображения шириной image_width, строки лежат с шагом in_stride и out_stride.
+	 * Пакеты строк должны идти по порядку, начиная с 0. in и out могут совпадать (с одинаковым шагом), кроме color indexing transform,
+	 * у которого in - строки упакованных индексов
+	 */
+	void inverse_rows(const uint32_t * in, const size_t & in_stride, uint32_t * out, const size_t & out_stride,
+						const uint32_t & y, const uint32_t & rows, const uint32_t & image_width)
 	{
-		if (m_type == VP8_LOSSLESS_TRANSFORM::PREDICTOR_TRANSFORM)
-			InversePredictorTransform(argb_image, image_width, image_height);
-		if (m_type == VP8_LOSSLESS_TRANSFORM::COLOR_TRANSFORM)
-			InverseColorTransform(argb_image, image_width, image_height);
-		if (m_type == VP8_LOSSLESS_TRANSFORM::COLOR_INDEXING_TRANSFORM)
-			InverseColorIndexingTransform(argb_image, image_width, image_height);
-		if (m_type == VP8_LOSSLESS_TRANSFORM::SUBTRACT_GREEN)
-			InverseSubstractGreenTransform(argb_image, image_width, image_height);
+		if (rows == 0)
+			return;
+		switch(m_type)
+		{
+			case(VP8_LOSSLESS_TRANSFORM::PREDICTOR_TRANSFORM):
+				if (m_prev_row.size() != image_width)
+					m_prev_row.realloc(image_width);
+				InversePredictorRows(in, in_stride, out, out_stride, y, rows, image_width);
+				break;
+			case(VP8_LOSSLESS_TRANSFORM::COLOR_TRANSFORM):
+				InverseColorRows(in, in_stride, out, out_stride, y, rows, image_width);
+				break;
+			case(VP8_LOSSLESS_TRANSFORM::COLOR_INDEXING_TRANSFORM):
+				InverseColorIndexingRows(in, in_stride, out, out_stride, rows, image_width);
+				break;
+			case(VP8_LOSSLESS_TRANSFORM::SUBTRACT_GREEN):
+				InverseSubstractGreenRows(in, in_stride, out, out_stride, rows, image_width);
+				break;
+			default:
+				break;
+		}
 	}
 };
 
@@ -6,12 +6,16 @@
 #include "color_cache.h"
 #include "transform.h"
 #include "huffman_io.h"
+#include "histogram.h"
+#include "palette.h"
+#include "lz77_cost.h"
+#include "stats.h"
 #include "../utils/bit_writer.h"
 #include "../lz77/lz77.h"
 //#include <openssl/sha.h>
 #include <png.h>
-#include <set>
 #include <math.h>
+#include <stdlib.h>
 
 
 namespace webp
@@ -20,13 +24,80 @@ namespace vp8l
 {
 
 
-#define PALLETE_MAX_COLORS 256
-#define LZ77_MAX_DISTANCE 1024
-#define LZ77_MAX_LENGTH 128
+//максимальные смещение и длина, допустимые форматом
+#define LZ77_MAX_DISTANCE ((1 << 20) - 120)
+#define LZ77_MAX_LENGTH 4096
 #define MAX_ARGB_IMAGE_SIZE 16384
+//сколько пикселей обратные трансформации обрабатывают за один пакет строк, пакет должен помещаться в L2
+#define INVERSE_TRANSFORM_BATCH_PIXELS (1 << 15)
 
+//уровень сжатия энкодера, чем выше, тем медленнее и лучше сжатие
+#define ENCODER_MAX_EFFORT 10
+#define ENCODER_DEFAULT_EFFORT 5
+//начиная с этого уровня LZ77 после жадного разбора переупаковывается оптимальным разбором по его стоимостям
+#define ENCODER_OPTIMAL_PARSE_EFFORT 10
+//глубина поиска по hash chain в LZ77 для каждого уровня сжатия
+static const uint32_t LZ77ChainDepth[ENCODER_MAX_EFFORT + 1] = { 0, 1, 2, 4, 8, 32, 64, 128, 256, 1024, 1024 };
+//гистограммы потока токенов строятся параллельно частями такого размера
+#define HISTOGRAM_CHUNK_TOKENS (1 << 18)
+//размер блока predictor transform в битах
+#define PREDICTOR_BITS 4
+//размер блока cross color transform в битах
+#define CROSS_COLOR_BITS 5
+//штраф в битах на пиксель блока за множитель, отличный от множителя соседнего блока
+#define CROSS_COLOR_CHANGE_PENALTY 0.05f
+//размер тайла entropy image в битах для каждого уровня сжатия, 0 - entropy image не пишется
+static const uint32_t HuffmanImageBits[ENCODER_MAX_EFFORT + 1] = { 0, 0, 0, 6, 6, 5, 5, 4, 4, 3, 3 };
+//если тайлов больше, их размер увеличивается
+#define HUFFMAN_IMAGE_MAX_TILES 4096
+#define HUFFMAN_IMAGE_MAX_BITS 9
+#define HUFFMAN_IMAGE_MAX_CLUSTERS 64
 
 
+
+/*
+ * Приемник строк декодированного изображения.
+ * begin вызывается один раз, когда известны размеры изображения, row - для каждой строки по порядку, как только к ней
+ * применены все обратные трансформации. Если поток окажется поврежден, исключение будет брошено уже после того,
+ * как часть строк передана в row
+ */
+class VP8_LOSSLESS_ROW_SINK
+{
+public:
+	virtual void begin(const uint32_t & width, const uint32_t & height) = 0;
+	virtual void row(const uint32_t & y, const uint32_t * argb) = 0;
+	virtual ~VP8_LOSSLESS_ROW_SINK()
+	{
+
+	}
+};
+
+/*
+ * Приемник, который собирает строки в одно ARGB изображение
+ */
+class VP8_LOSSLESS_IMAGE_SINK : public VP8_LOSSLESS_ROW_SINK
+{
+private:
+	utils::pixel_array &	m_argb_image;
+	uint32_t				m_width;
+	VP8_LOSSLESS_IMAGE_SINK & operator=(const VP8_LOSSLESS_IMAGE_SINK &);
+public:
+	VP8_LOSSLESS_IMAGE_SINK(utils::pixel_array & argb_image)
+		: m_argb_image(argb_image), m_width(0)
+	{
+
+	}
+	void begin(const uint32_t & width, const uint32_t & height)
+	{
+		m_width = width;
+		m_argb_image.realloc(width * height);
+	}
+	void row(const uint32_t & y, const uint32_t * argb)
+	{
+		memcpy(&m_argb_image[y * m_width], argb, m_width * sizeof(uint32_t));
+	}
+};
+
 class VP8_LOSSLESS_DECODER
 {
 private:
@@ -43,6 +114,13 @@ private:
 		{
 
 		}
+		//готовит набор к чтению следующего изображения, таблицы Хаффмана и entropy image переиспользуются
+		void reset()
+		{
+			huffman_bits = 0;
+			huffman_xsize = 0;
+			meta_huffman_codes_num = 1;
+		}
 	};
 private:
 	//прочитано из заголовка vp8l
@@ -66,10 +144,24 @@ private:
 	//иначе m_color_indexing_xsize и есть эта ширина
 	uint32_t					m_color_indexing_xsize;
 
-	VP8_LOSSLESS_DECODER()
-	{
+	//строки, переданные в приемник, и буферы для обратных трансформаций пакета строк
+	VP8_LOSSLESS_ROW_SINK *		m_sink;
+	uint32_t					m_rows_emitted;
+	uint32_t					m_batch_rows;
+	uint32_t					m_batch_stride;
+	utils::pixel_array			m_row_buffers[2];
+
+	//буферы декодирования остаются между вызовами Decode: изображение до обратных трансформаций, коды Хаффмана
+	//основного изображения и вложенных(трансформаций и entropy image). Память только растет
+	utils::pixel_array			m_argb_image;
+	MetaHuffmanInfo				m_meta_huffman_info;
+	MetaHuffmanInfo				m_entropy_huffman_info;
+
+	//статистика декодирования, может быть NULL
+	Stats *						m_stats;
+	//время EmitRows внутри декодирования основного изображения, см. ReadLZ77CodedImage
+	double						m_emit_seconds;
 
-	}
 	VP8_LOSSLESS_DECODER & operator=(const VP8_LOSSLESS_DECODER&)
 	{
 		return *this;
@@ -92,6 +184,32 @@ private:
 		m_alpha_is_used  = m_bit_reader.ReadBits(1);
 		m_version_number = m_bit_reader.ReadBits(3);
 	}
+	/*
+	 * Decode()
+	 * Бросает исключения: UnsupportedVP8, InvalidVP8L, InvalidHuffman
+	 * Назначение:
+	 * читает заголовок, трансформации и изображение, передавая восстановленные строки в sink
+	 */
+	void Decode(VP8_LOSSLESS_ROW_SINK & sink)
+	{
+		m_transforms.clear();
+		m_transforms_order.clear();
+		ReadInfo();
+		m_color_indexing_xsize = 0;
+		m_sink = &sink;
+		m_sink->begin(m_image_width, m_image_height);
+
+		StageTimer timer(m_stats, "transforms");
+		const size_t transforms_start = m_bit_reader.position();
+		while(m_bit_reader.ReadBits(1))
+			ReadTransform();
+		if (m_stats != NULL)
+			m_stats->transform_bits += m_bit_reader.position() - transforms_start;
+		timer.stop();
+		ReadSpatiallyCodedImage();
+		if (m_bit_reader.error())
+			throw exception::InvalidVP8L();
+	}
 	/*
 	 * ReadTransform()
 	 * Бросает исключения: InvalidVP8
@@ -164,10 +282,13 @@ private:
 		VP8_LOSSLESS_COLOR_CACHE color_cache(color_cache_bits);
 		uint32_t color_cache_size = color_cache_bits == 0 ? 0 :1 << color_cache_bits;
 
-		MetaHuffmanInfo meta_huffman_info;
+		MetaHuffmanInfo & meta_huffman_info = m_entropy_huffman_info;
+		meta_huffman_info.reset();
+		if (meta_huffman_info.meta_huffmans.empty())
+			meta_huffman_info.meta_huffmans.resize(1);
 
 		//восстанавливаем дерево Хаффмана
-		meta_huffman_info.meta_huffmans.push_back(huffman_io::dec::VP8_LOSSLESS_HUFFMAN(&m_bit_reader, color_cache_size));
+		meta_huffman_info.meta_huffmans[0].read(&m_bit_reader, color_cache_size);
 		//декодируем entropy-coded image
 		ReadLZ77CodedImage(meta_huffman_info, xsize, ysize, data, color_cache);
 	}
@@ -177,8 +298,10 @@ private:
 	 * Назначение:
 	 * Читает и декодирует spatially coded image
 	 */
-	void ReadSpatiallyCodedImage(utils::pixel_array & argb_image)
+	void ReadSpatiallyCodedImage()
 	{
+		const size_t image_start = m_bit_reader.position();
+		size_t entropy_image_bits = 0;
 		uint32_t color_cache_bits =	ReadColorCacheBits();
 		VP8_LOSSLESS_COLOR_CACHE color_cache(color_cache_bits);
 		uint32_t color_cache_size = color_cache_bits == 0 ? 0 :1 << color_cache_bits;
@@ -187,7 +310,8 @@ private:
 		uint32_t entropy_image_size = 0;
 		//Кол-во мета кодов Хаффмана в наборе,
 		//если имеется meta-huffman, то кол-во мета кодов отлично от 1
-		MetaHuffmanInfo meta_huffman_info;
+		MetaHuffmanInfo & meta_huffman_info = m_meta_huffman_info;
+		meta_huffman_info.reset();
 		if (use_meta_huffman_codes)
 		{
 			//декодируем meta huffman
@@ -196,7 +320,11 @@ private:
 			uint32_t huffman_ysize = DIV_ROUND_UP(m_image_height, 1 << huffman_bits);
 			entropy_image_size  = huffman_xsize * huffman_ysize;
 			meta_huffman_info.entropy_image.realloc(entropy_image_size);
+			StageTimer timer(m_stats, "entropy image");
+			const size_t entropy_image_start = m_bit_reader.position();
 			ReadEntropyCodedImage(huffman_xsize, huffman_ysize, meta_huffman_info.entropy_image);
+			entropy_image_bits = m_bit_reader.position() - entropy_image_start;
+			timer.stop();
 
 			meta_huffman_info.huffman_xsize = huffman_xsize;
 			meta_huffman_info.huffman_bits = huffman_bits;
@@ -214,12 +342,81 @@ private:
 			}
 		}
 
+		StageTimer huffman_timer(m_stats, "huffman codes");
+		const size_t huffman_start = m_bit_reader.position();
+		if (meta_huffman_info.meta_huffmans.size() < meta_huffman_info.meta_huffman_codes_num)
+			meta_huffman_info.meta_huffmans.resize(meta_huffman_info.meta_huffman_codes_num);
 		for(uint32_t i = 0; i < meta_huffman_info.meta_huffman_codes_num; i++)
-			meta_huffman_info.meta_huffmans.push_back(huffman_io::dec::VP8_LOSSLESS_HUFFMAN(&m_bit_reader, color_cache_size));
+			meta_huffman_info.meta_huffmans[i].read(&m_bit_reader, color_cache_size);
+		if (m_stats != NULL)
+		{
+			m_stats->huffman_codes += meta_huffman_info.meta_huffman_codes_num * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE;
+			m_stats->huffman_header_bits += m_bit_reader.position() - huffman_start;
+		}
+		huffman_timer.stop();
 
 		//см описание m_color_indexing_xsize
 		uint32_t xsize =  m_color_indexing_xsize == 0 ? m_image_width : m_color_indexing_xsize;
-		ReadLZ77CodedImage(meta_huffman_info, xsize, m_image_height, argb_image, color_cache);
+		//на декодированные пиксели могут ссылаться копии LZ77, поэтому изображение до обратных трансформаций хранится целиком,
+		//а восстановленные строки живут только в буферах
+		if (m_argb_image.size() < xsize * m_image_height)
+			m_argb_image.realloc(xsize * m_image_height);
+		m_rows_emitted = 0;
+		m_batch_stride = xsize > m_image_width ? xsize : m_image_width;
+		m_batch_rows = INVERSE_TRANSFORM_BATCH_PIXELS / m_batch_stride;
+		if (m_batch_rows == 0)
+			m_batch_rows = 1;
+		if (m_batch_rows > m_image_height)
+			m_batch_rows = m_image_height;
+		for(size_t i = 0; i < 2; i++)
+			if (m_row_buffers[i].size() < m_batch_rows * m_batch_stride)
+				m_row_buffers[i].realloc(m_batch_rows * m_batch_stride);
+		//обратные трансформации и выдача строк идут вперемешку с декодированием, их время считается отдельно
+		StageTimer timer(m_stats, "lz77 decode");
+		m_emit_seconds = 0.0;
+		ReadLZ77CodedImage(meta_huffman_info, xsize, m_image_height, m_argb_image, color_cache, true);
+		timer.exclude(m_emit_seconds);
+		timer.stop();
+		if (m_stats != NULL)
+		{
+			m_stats->entropy_image_bits += entropy_image_bits;
+			m_stats->main_image_bits += m_bit_reader.position() - image_start - entropy_image_bits;
+		}
+	}
+	/*
+	 * EmitRows
+	 * Бросает исключения: InvalidVP8L
+	 * Назначение:
+	 * применяет обратные трансформации к строкам [m_rows_emitted, rows) пакетами по m_batch_rows строк и передает их в приемник.
+	 * Все трансформации проходят по пакету, пока он в кэше. Неполный пакет обрабатывается только в конце изображения
+	 */
+	void EmitRows(const utils::pixel_array & argb_image, const uint32_t & xsize, const uint32_t & rows)
+	{
+		while(m_rows_emitted < rows && (rows - m_rows_emitted >= m_batch_rows || rows == m_image_height))
+		{
+			const uint32_t batch = rows - m_rows_emitted < m_batch_rows ? rows - m_rows_emitted : m_batch_rows;
+			//первая трансформация читает прямо из декодированного изображения, остальные работают в буфере пакета
+			const uint32_t * in = &argb_image[m_rows_emitted * xsize];
+			size_t in_stride = xsize;
+			uint32_t * out = &m_row_buffers[0][0];
+			StageTimer transforms_timer(m_stats, "inverse transforms");
+			for(std::list<VP8_LOSSLESS_TRANSFORM::Type>::iterator iter = m_transforms_order.begin(); iter != m_transforms_order.end(); ++iter)
+			{
+				VP8_LOSSLESS_TRANSFORM & transform = m_transforms[*iter];
+				//индексы упакованы, поэтому color indexing пишет в другой буфер
+				if (transform.type() == VP8_LOSSLESS_TRANSFORM::COLOR_INDEXING_TRANSFORM && in == out)
+					out = out == &m_row_buffers[0][0] ? &m_row_buffers[1][0] : &m_row_buffers[0][0];
+				transform.inverse_rows(in, in_stride, out, m_batch_stride, m_rows_emitted, batch, m_image_width);
+				in = out;
+				in_stride = m_batch_stride;
+			}
+			m_emit_seconds += transforms_timer.stop();
+			StageTimer output_timer(m_stats, "output rows");
+			for(uint32_t r = 0; r < batch; r++)
+				m_sink->row(m_rows_emitted + r, in + r * in_stride);
+			m_emit_seconds += output_timer.stop();
+			m_rows_emitted += batch;
+		}
 	}
 	/*
 	 * ReadColorCacheInfo()
@@ -261,13 +458,20 @@ private:
 	 * читает и декодирует lz77 coded image
 	 */
 	void ReadLZ77CodedImage(const MetaHuffmanInfo & meta_huffman_info, const uint32_t & xsize, const uint32_t & ysize, utils::pixel_array & data,
-								VP8_LOSSLESS_COLOR_CACHE & color_cache)
+								VP8_LOSSLESS_COLOR_CACHE & color_cache, const bool & emit_rows = false)
 	{
 		uint32_t data_fills = 0;
 		uint32_t last_cached = data_fills;
 		uint32_t x = 0, y = 0;
+		//счетчики токенов для статистики
+		uint32_t literals = 0, copies = 0, cache_hits = 0, copied_pixels = 0;
 		while(data_fills != xsize * ysize)
 		{
+			if (m_bit_reader.error())
+				throw exception::InvalidVP8L();
+			//строки выше текущей декодированы полностью
+			if (emit_rows && y - m_rows_emitted >= m_batch_rows)
+				EmitRows(data, xsize, y);
 			const huffman_io::dec::VP8_LOSSLESS_HUFFMAN & huffman = meta_huffman_info.meta_huffmans[SelectMetaHuffman(meta_huffman_info, x, y)];
 			int32_t S = huffman.read_symbol(huffman_io::GREEN);
 			//если прочитанное значение меньше 256, значит это значение зеленой компоненты цвета пикселя, а дальше идут красная,
@@ -278,6 +482,7 @@ private:
 				int32_t blue  = huffman.read_symbol(huffman_io::BLUE);
 				int32_t alpha = huffman.read_symbol(huffman_io::ALPHA);
 				data[data_fills++] = (alpha << 24) + (red << 16) + (S << 8) + blue;
+				literals++;
 				x++;
 				if (x >= xsize)
 				{
@@ -295,6 +500,10 @@ private:
 				prefix_code = huffman.read_symbol(huffman_io::DIST_PREFIX);
 				uint32_t lz77_distance_code = lz77::prefix_coding_decode(prefix_code, m_bit_reader);
 				uint32_t lz77_distance = lz77::distance_code2distance(xsize, lz77_distance_code);
+				if (lz77_distance > data_fills || lz77_length > xsize * ysize - data_fills)
+					throw exception::InvalidVP8L();
+				copies++;
+				copied_pixels += lz77_length;
 				for(uint32_t i = 0; i < lz77_length; i++, data_fills++)
 				{
 					data[data_fills] = data[data_fills - lz77_distance];
@@ -315,6 +524,7 @@ private:
 				while(last_cached < data_fills)
 					color_cache.insert(data[last_cached++]);
 				data[data_fills++] = color_cache.get(color_cache_key);
+				cache_hits++;
 				x++;
 				if (x >= xsize)
 				{
@@ -325,23 +535,55 @@ private:
 				}
 			}
 		}
+		if (emit_rows)
+			EmitRows(data, xsize, ysize);
+		if (emit_rows && m_stats != NULL)
+		{
+			m_stats->literals += literals;
+			m_stats->copies += copies;
+			m_stats->cache_hits += cache_hits;
+			m_stats->copied_pixels += copied_pixels;
+		}
 	}
 public:
-	VP8_LOSSLESS_DECODER(const uint8_t * const data, uint32_t data_length, utils::pixel_array & argb_image)
-		: m_bit_reader(data, data_length)
+	/*
+	 * Декодер без изображения, изображения декодируются вызовами Decode, буферы переиспользуются между ними
+	 */
+	VP8_LOSSLESS_DECODER()
+		: m_stats(NULL)
 	{
-		ReadInfo();
-
-		argb_image.realloc(m_image_width * m_image_height);
-		argb_image.fill(0);
-		m_color_indexing_xsize = 0;
 
-		while(m_bit_reader.ReadBits(1))
-			ReadTransform();
-		ReadSpatiallyCodedImage(argb_image);
-
-		for(std::list<VP8_LOSSLESS_TRANSFORM::Type>::iterator iter = m_transforms_order.begin(); iter != m_transforms_order.end(); ++iter)
-			m_transforms[*iter].inverse(argb_image, m_image_width, m_image_height);
+	}
+	/*
+	 * Исключения: UnsupportedVP8, InvalidVP8L, InvalidHuffman
+	 * Декодирует изображение целиком в argb_image, если stats != NULL, заполняет статистику декодирования
+	 */
+	VP8_LOSSLESS_DECODER(const uint8_t * const data, uint32_t data_length, utils::pixel_array & argb_image, Stats * stats = NULL)
+		: m_stats(NULL)
+	{
+		VP8_LOSSLESS_IMAGE_SINK sink(argb_image);
+		Decode(data, data_length, sink, stats);
+	}
+	/*
+	 * Исключения: UnsupportedVP8, InvalidVP8L, InvalidHuffman
+	 * Декодирует изображение, передавая строки в sink по мере готовности, если stats != NULL, заполняет статистику декодирования
+	 */
+	VP8_LOSSLESS_DECODER(const uint8_t * const data, uint32_t data_length, VP8_LOSSLESS_ROW_SINK & sink, Stats * stats = NULL)
+		: m_stats(NULL)
+	{
+		Decode(data, data_length, sink, stats);
+	}
+	/*
+	 * Decode
+	 * Бросает исключения: UnsupportedVP8, InvalidVP8L, InvalidHuffman
+	 * Назначение:
+	 * декодирует следующее изображение, передавая строки в sink, если stats != NULL, заполняет статистику декодирования
+	 */
+	void Decode(const uint8_t * const data, uint32_t data_length, VP8_LOSSLESS_ROW_SINK & sink, Stats * stats = NULL)
+	{
+		m_bit_reader.reset(data, data_length);
+		m_stats = stats;
+		Decode(sink);
 	}
 	const uint32_t image_width(){
 		return m_image_width;
@@ -356,7 +598,6 @@ public:
 class VP8_LOSSLESS_ENCODER
 {
 public:
-	typedef std::set<uint32_t> palette_t;
 	struct entropy_t{
 		float 	red_p[256];
 		float	blue_p[256];
@@ -365,18 +606,17 @@ public:
 		float	entropy;
 	};
 	utils::BitWriter m_bit_writer;
+	uint32_t		 m_effort;
+	utils::ThreadPool m_thread_pool;
+	//узлы всех деревьев Хаффмана, которые строит энкодер
+	huffman_coding::enc::HuffmanNodePool m_huffman_node_pool;
+	//статистика кодирования, может быть NULL
+	Stats *			 m_stats;
 	VP8_LOSSLESS_ENCODER()
+		: m_effort(ENCODER_DEFAULT_EFFORT), m_thread_pool(1), m_stats(NULL),
+		  m_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH), m_sub_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH)
 	{
 
-	}
-	void CreatePallete(const utils::pixel_array & argb_image, palette_t & pallete) const{
-		for(size_t i = 0; i < argb_image.size(); i++){
-			pallete.insert(argb_image[i]);
-			if (pallete.size() > PALLETE_MAX_COLORS){
-				pallete.clear();
-				return;
-			}
-		}
 	}
 	void AnalyzeEntropy(const utils::pixel_array & argb_image, entropy_t & entropy) const {
 		memset(&entropy, 0, sizeof(entropy));
@@ -408,18 +648,297 @@ public:
 			}
 		}
 	}
-	void ApplySubtractGreenTransform(utils::pixel_array & argb_image){
-		printf("Applying subract green transform...\n");
-		for(size_t i = 0; i < argb_image.size(); i++){
-			*utils::RED(argb_image[i])  = (*utils::RED(argb_image[i])  - *utils::GREEN(argb_image[i])) & 0xff;
-			*utils::BLUE(argb_image[i]) = (*utils::BLUE(argb_image[i]) - *utils::GREEN(argb_image[i])) & 0xff;
+	/*
+	 * HistogramEntropy
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * энтропия в битах count символов с гистограммой histo из 256 значений: N * log2(N) - sum(c * log2(c))
+	 */
+	static float HistogramEntropy(const uint32_t * histo, const size_t & count){
+		float cost = histogram::SLog2(count);
+		//счетчики не больше count, для блоков трансформаций они всегда попадают в таблицу
+		if (count < HISTOGRAM_LOG_TABLE_SIZE){
+			const float * slog2 = histogram::SLog2Table();
+			for(size_t i = 0; i < 256; i++)
+				cost -= slog2[histo[i]];
+			return cost;
 		}
+		for(size_t i = 0; i < 256; i++)
+			cost -= histogram::SLog2(histo[i]);
+		return cost;
+	}
+	void ApplySubtractGreenTransform(utils::pixel_array & argb_image){
+		VP8L_LOG("Applying subract green transform...\n");
+		dsp::SubtractGreenFromBlueAndRed(&argb_image[0], &argb_image[0], argb_image.size());
 		m_bit_writer.WriteBit(1);//transform present
 		m_bit_writer.WriteBits(VP8_LOSSLESS_TRANSFORM::SUBTRACT_GREEN, 2);
 	}
-	size_t ApplyColorIndexingTransform(const size_t & xsize, const size_t & ysize, const  utils::pixel_array & palette_array, utils::pixel_array & argb_image){
-		printf("Applying color indexing transorm\n");
-		printf("	Palette size=%u\n", palette_array.size());
+	/*
+	 * PredictorResidual
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * разность пикселя (x, y) и его предсказания режимом mode, соседи и края обрабатываются так же, как в
+	 * VP8_LOSSLESS_TRANSFORM::InversePredictorTransform
+	 */
+	static uint32_t PredictorResidual(const uint32_t * image, const size_t & width, const size_t & x, const size_t & y,
+										const uint32_t & mode){
+		const uint32_t * pixel = image + y * width + x;
+		uint32_t P;
+		if (x == 0 && y == 0)
+			P = 0xff000000;
+		else if (x == 0)
+			P = *(pixel - width);
+		else if (y == 0)
+			P = *(pixel - 1);
+		else{
+			const uint32_t L = *(pixel - 1);
+			const uint32_t T = *(pixel - width);
+			const uint32_t TR = (x == width - 1) ? L : *(pixel - width + 1);
+			const uint32_t TL = *(pixel - width - 1);
+			P = Predict(mode, L, T, TR, TL);
+		}
+		uint32_t residual = *pixel;
+		PixelsSub(&residual, P);
+		return residual;
+	}
+	/*
+	 * PredictorResiduals
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * остатки предсказания режимом mode для пикселей [x_begin, x_end) строки y. Внутренние пиксели считает ядро dsp,
+	 * края изображения - PredictorResidual
+	 */
+	static void PredictorResiduals(const uint32_t * image, const size_t & width, const size_t & y, const size_t & x_begin,
+									const size_t & x_end, const uint32_t & mode, uint32_t * residuals){
+		if (y == 0){
+			for(size_t x = x_begin; x < x_end; x++)
+				residuals[x - x_begin] = PredictorResidual(image, width, x, y, mode);
+			return;
+		}
+		const uint32_t * row = image + y * width;
+		size_t x = x_begin;
+		if (x == 0 && x < x_end){
+			residuals[0] = PredictorResidual(image, width, 0, y, mode);
+			x++;
+		}
+		//у последнего пикселя строки нет соседа сверху справа
+		const size_t interior_end = x_end < width - 1 ? x_end : width - 1;
+		if (x < interior_end){
+			dsp::PredictorSub[mode](row + x, row - width + x, interior_end - x, residuals + (x - x_begin));
+			x = interior_end;
+		}
+		for(; x < x_end; x++)
+			residuals[x - x_begin] = PredictorResidual(image, width, x, y, mode);
+	}
+	/*
+	 * SelectPredictorModes
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * для каждого блока 1 << bits выбирает режим предсказания, при котором энтропия остатков блока минимальна.
+	 * Строки блоков обрабатываются параллельно
+	 */
+	void SelectPredictorModes(const utils::pixel_array & argb_image, const size_t & width, const size_t & height,
+								const uint32_t & bits, utils::pixel_array & modes){
+		const size_t block_xsize = DIV_ROUND_UP(width, 1 << bits);
+		const size_t block_ysize = DIV_ROUND_UP(height, 1 << bits);
+		const size_t block_size = (size_t)1 << bits;
+		modes.realloc(block_xsize * block_ysize);
+		m_thread_pool.parallel_for(block_ysize, [&](size_t block_y){
+			uint32_t histo[4][256];
+			std::vector<uint32_t> residuals(block_size);
+			const size_t y_begin = block_y << bits;
+			const size_t y_end = y_begin + block_size < height ? y_begin + block_size : height;
+			for(size_t block_x = 0; block_x < block_xsize; block_x++){
+				const size_t x_begin = block_x << bits;
+				const size_t x_end = x_begin + block_size < width ? x_begin + block_size : width;
+				float best_cost = 0;
+				uint32_t best_mode = 0;
+				for(uint32_t mode = 0; mode < PREDICTOR_MODES_COUNT; mode++){
+					memset(histo, 0, sizeof(histo));
+					for(size_t y = y_begin; y < y_end; y++){
+						PredictorResiduals(&argb_image[0], width, y, x_begin, x_end, mode, &residuals[0]);
+						for(size_t i = 0; i < x_end - x_begin; i++){
+							const uint32_t residual = residuals[i];
+							++histo[0][residual >> 24];
+							++histo[1][(residual >> 16) & 0xff];
+							++histo[2][(residual >> 8) & 0xff];
+							++histo[3][residual & 0xff];
+						}
+					}
+					float cost = 0;
+					for(size_t c = 0; c < 4; c++)
+						cost += HistogramEntropy(histo[c], (y_end - y_begin) * (x_end - x_begin));
+					if (mode == 0 || cost < best_cost){
+						best_cost = cost;
+						best_mode = mode;
+					}
+				}
+				modes[block_y * block_xsize + block_x] = 0xff000000 | (best_mode << 8);
+			}
+		});
+	}
+	/*
+	 * ApplyPredictorTransform
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * заменяет пиксели остатками предсказания, если это уменьшает энтропию изображения
+	 */
+	void ApplyPredictorTransform(const size_t & width, const size_t & height, utils::pixel_array & argb_image){
+		const uint32_t bits = PREDICTOR_BITS;
+		const size_t block_xsize = DIV_ROUND_UP(width, 1 << bits);
+		const size_t block_ysize = DIV_ROUND_UP(height, 1 << bits);
+		utils::pixel_array modes;
+		SelectPredictorModes(argb_image, width, height, bits, modes);
+
+		utils::pixel_array residuals(argb_image.size());
+		m_thread_pool.parallel_for(block_ysize, [&](size_t block_y){
+			const size_t y_begin = block_y << bits;
+			const size_t y_end = y_begin + (1 << bits) < height ? y_begin + (1 << bits) : height;
+			for(size_t y = y_begin; y < y_end; y++)
+				for(size_t block_x = 0; block_x < block_xsize; block_x++){
+					const uint32_t mode = (modes[block_y * block_xsize + block_x] >> 8) & 0xff;
+					const size_t x_begin = block_x << bits;
+					const size_t x_end = x_begin + (1 << bits) < width ? x_begin + (1 << bits) : width;
+					PredictorResiduals(&argb_image[0], width, y, x_begin, x_end, mode, &residuals[y * width + x_begin]);
+				}
+		});
+
+		entropy_t image_entropy, residuals_entropy;
+		AnalyzeEntropy(argb_image, image_entropy);
+		AnalyzeEntropy(residuals, residuals_entropy);
+		if (residuals_entropy.entropy >= image_entropy.entropy)
+			return;
+
+		VP8L_LOG("Applying predictor transform...\n");
+		argb_image.move_ref(residuals);
+		m_bit_writer.WriteBit(1);//transform present
+		m_bit_writer.WriteBits(VP8_LOSSLESS_TRANSFORM::PREDICTOR_TRANSFORM, 2);
+		m_bit_writer.WriteBits(bits - 2, 3);
+		WriteEntropyCodedImage(block_xsize, block_ysize, modes);
+	}
+	/*
+	 * SearchColorMultiplier
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * ищет множитель, минимизирующий энтропию компоненты(сдвиг shift), которая получается прямым cross color transform
+	 * с множителями element(multiplier). Сначала проверяются 0 и множитель соседнего блока, затем значения с шагом 8
+	 * и уточнение вокруг лучшего. Множитель, отличный от соседнего, штрафуется
+	 */
+	template<typename Element>
+	static int8_t SearchColorMultiplier(const utils::pixel_array & argb_image, const size_t & width,
+										const size_t & x_begin, const size_t & x_end, const size_t & y_begin, const size_t & y_end,
+										const int8_t & neighbour, const uint32_t & shift, Element element){
+		uint32_t histo[256];
+		std::vector<uint32_t> residuals(x_end - x_begin);
+		const size_t count = (x_end - x_begin) * (y_end - y_begin);
+		int8_t best = 0;
+		float best_cost = 0;
+		bool first = true;
+		const auto evaluate = [&](const int32_t & candidate){
+			const int8_t multiplier = (int8_t)candidate;
+			const ColorTransformElement cte = element(multiplier);
+			memset(histo, 0, sizeof(histo));
+			for(size_t y = y_begin; y < y_end; y++){
+				dsp::TransformColor(cte, &argb_image[y * width + x_begin], &residuals[0], x_end - x_begin);
+				for(size_t i = 0; i < x_end - x_begin; i++)
+					++histo[(residuals[i] >> shift) & 0xff];
+			}
+			float cost = HistogramEntropy(histo, count);
+			//смена множителя относительно соседа удорожает подызображение
+			if (multiplier != neighbour)
+				cost += count * CROSS_COLOR_CHANGE_PENALTY;
+			if (first || cost < best_cost){
+				best_cost = cost;
+				best = multiplier;
+				first = false;
+			}
+		};
+		evaluate(0);
+		if (neighbour != 0)
+			evaluate(neighbour);
+		for(int32_t candidate = -128; candidate < 128; candidate += 8)
+			if (candidate != 0 && candidate != neighbour)
+				evaluate(candidate);
+		const int32_t center = best;
+		for(int32_t candidate = center - 7; candidate <= center + 7; candidate++)
+			if (candidate >= -128 && candidate < 128 && candidate != center && candidate != neighbour && (candidate & 7) != 0)
+				evaluate(candidate);
+		return best;
+	}
+	/*
+	 * ApplyCrossColorTransform
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * для каждого блока 1 << bits подбирает множители green_to_red, green_to_blue и red_to_blue
+	 * и вычитает поправки из красной и синей компонент, если это уменьшает энтропию изображения
+	 */
+	void ApplyCrossColorTransform(const size_t & width, const size_t & height, utils::pixel_array & argb_image){
+		const uint32_t bits = CROSS_COLOR_BITS;
+		const size_t block_size = (size_t)1 << bits;
+		const size_t block_xsize = DIV_ROUND_UP(width, block_size);
+		const size_t block_ysize = DIV_ROUND_UP(height, block_size);
+
+		utils::pixel_array elements(block_xsize * block_ysize);
+		utils::pixel_array residuals(argb_image.size());
+		m_thread_pool.parallel_for(block_ysize, [&](size_t block_y){
+			const size_t y_begin = block_y << bits;
+			const size_t y_end = y_begin + block_size < height ? y_begin + block_size : height;
+			ColorTransformElement left(0);
+			for(size_t block_x = 0; block_x < block_xsize; block_x++){
+				const size_t x_begin = block_x << bits;
+				const size_t x_end = x_begin + block_size < width ? x_begin + block_size : width;
+				ColorTransformElement cte(0);
+				cte.green_to_red = SearchColorMultiplier(argb_image, width, x_begin, x_end, y_begin, y_end, left.green_to_red, 16,
+					[](const int8_t & green_to_red){
+						ColorTransformElement element(0);
+						element.green_to_red = green_to_red;
+						return element;
+					});
+				cte.green_to_blue = SearchColorMultiplier(argb_image, width, x_begin, x_end, y_begin, y_end, left.green_to_blue, 0,
+					[](const int8_t & green_to_blue){
+						ColorTransformElement element(0);
+						element.green_to_blue = green_to_blue;
+						return element;
+					});
+				const int8_t green_to_blue = cte.green_to_blue;
+				cte.red_to_blue = SearchColorMultiplier(argb_image, width, x_begin, x_end, y_begin, y_end, left.red_to_blue, 0,
+					[green_to_blue](const int8_t & red_to_blue){
+						ColorTransformElement element(0);
+						element.green_to_blue = green_to_blue;
+						element.red_to_blue = red_to_blue;
+						return element;
+					});
+				left = cte;
+				//порядок компонент такой же, как в конструкторе ColorTransformElement
+				elements[block_y * block_xsize + block_x] = 0xff000000 | (cte.red_to_blue << 16) | (cte.green_to_blue << 8) | cte.green_to_red;
+
+				for(size_t y = y_begin; y < y_end; y++)
+					dsp::TransformColor(cte, &argb_image[y * width + x_begin], &residuals[y * width + x_begin], x_end - x_begin);
+			}
+		});
+
+		bool identity = true;
+		for(size_t i = 0; i < elements.size() && identity; i++)
+			identity = (elements[i] & 0x00ffffff) == 0;
+		if (identity)
+			return;
+		entropy_t image_entropy, residuals_entropy;
+		AnalyzeEntropy(argb_image, image_entropy);
+		AnalyzeEntropy(residuals, residuals_entropy);
+		if (residuals_entropy.entropy >= image_entropy.entropy)
+			return;
+
+		VP8L_LOG("Applying cross color transform...\n");
+		argb_image.move_ref(residuals);
+		m_bit_writer.WriteBit(1);//transform present
+		m_bit_writer.WriteBits(VP8_LOSSLESS_TRANSFORM::COLOR_TRANSFORM, 2);
+		m_bit_writer.WriteBits(bits - 2, 3);
+		WriteEntropyCodedImage(block_xsize, block_ysize, elements);
+	}
+	size_t ApplyColorIndexingTransform(const size_t & xsize, const size_t & ysize, const utils::pixel_array & palette_array,
+										const PaletteHash & palette, utils::pixel_array & argb_image){
+		VP8L_LOG("Applying color indexing transorm\n");
+		VP8L_LOG("	Palette size=%u\n", palette_array.size());
 		uint32_t bits = (palette_array.size() > 16) ? 0 //пиксели не объединены
 					  : (palette_array.size() > 4) ? 1 //2 пикселя объединены, индексы в пределах [0..15]
 					  : (palette_array.size() > 2) ? 2 //4 пикселя объединены, индексы в пределах [0..3]
@@ -432,15 +951,17 @@ public:
 		uint32_t * src = &argb_image[0];
 		uint32_t * dst = &dst_argb_image[0];
 
+		uint32_t last_pix = ~src[0];
+		uint8_t last_index = 0;
 		for (size_t y = 0; y < ysize; ++y) {
 			for (size_t x = 0; x < xsize; ++x) {
 				const uint32_t pix = src[x];
-				 for (size_t i = 0; i < palette_array.size(); ++i) {
-					if (pix == palette_array[i]) {
-						row[x] = i;
-						break;
-					}
+				//в палитровых изображениях длинные серии одного цвета, хэш для них не нужен
+				if (pix != last_pix) {
+					last_pix = pix;
+					last_index = palette.index(pix);
 				}
+				row[x] = last_index;
 			}
 			BundleColorMap(&row[0], xsize, bits, dst);
 			src += xsize;
@@ -452,163 +973,475 @@ public:
 		m_bit_writer.WriteBits(VP8_LOSSLESS_TRANSFORM::COLOR_INDEXING_TRANSFORM, 2);
 		m_bit_writer.WriteBits(palette_array.size() - 1, 8);
 
-		for (size_t i = palette_array.size() - 1; i >= 1; --i)
-			PixelsSub(&palette_array[i], palette_array[i - 1]);
-		WriteEntropyCodedImage(palette_array.size(), 1, palette_array);
+		//палитра пишется subtraction-coded, вычитание идет в копии
+		utils::pixel_array coded_palette(palette_array);
+		for (size_t i = coded_palette.size() - 1; i >= 1; --i)
+			PixelsSub(&coded_palette[i], coded_palette[i - 1]);
+		WriteEntropyCodedImage(coded_palette.size(), 1, coded_palette);
 		return color_indexing_xsize;
 	}
 	void write_info(const uint32_t & width, const uint32_t & height){
-		m_bit_writer.WriteBits(0, 32);
+		m_bit_writer.WriteBits(0, 32);//размер чанка VP8L, заполняется WebP_ENCODER
 		m_bit_writer.WriteBits('\x2F', 8);
 		m_bit_writer.WriteBits(width - 1, 14);
 		m_bit_writer.WriteBits(height - 1, 14);
 		m_bit_writer.WriteBits(0, 1);
 		m_bit_writer.WriteBits(0, 3);
 	}
-	struct HuffmanTree{
-		histoarray histo;
-		huffman_coding::enc::HuffmanTree * tree;
-		HuffmanTree(const size_t & num_symbols)
-			: histo(num_symbols)
+	typedef lz77::LZ77<uint32_t> lz77_t;
+	/*
+	 * Набор мета кодов Хаффмана и entropy image, по которому для каждого пикселя выбирается мета код,
+	 * как в VP8_LOSSLESS_DECODER::SelectMetaHuffman
+	 */
+	struct MetaHuffmanCodes{
+		//по HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE деревьев на каждый мета код
+		utils::array<huffman_coding::enc::HuffmanTree> trees;
+		//мета код каждого тайла, пуст, если мета код один
+		std::vector<uint32_t> tile_codes;
+		uint32_t huffman_bits;
+		size_t huffman_xsize;
+		size_t huffman_ysize;
+		MetaHuffmanCodes()
+			: huffman_bits(0), huffman_xsize(0), huffman_ysize(0)
 		{
-			histo.fill(0);
+
+		}
+		uint32_t code(const size_t & x, const size_t & y) const{
+			if (tile_codes.empty())
+				return 0;
+			return tile_codes[(y >> huffman_bits) * huffman_xsize + (x >> huffman_bits)];
+		}
+		const huffman_coding::enc::HuffmanTree * select(const size_t & x, const size_t & y) const{
+			return &trees[code(x, y) * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE];
 		}
 	};
-	void WriteEntropyCodedImage(const size_t & xsize, const size_t & ysize, const utils::pixel_array & data){
-		m_bit_writer.WriteBit(0);//no color cache
-
-		lz77::LZ77<uint32_t> lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH, data);
-
-		histoarray histos[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE] = { histoarray(256 + 24), histoarray(256), histoarray(256), histoarray(256), histoarray(40)};
-		for(size_t i = 0; i < lz77.output().size(); i++){
-			if (lz77.output()[i].length == 0 && lz77.output()[i].distance == 0){
-				++histos[huffman_io::GREEN][*utils::GREEN(lz77.output()[i].symbol)];
-				++histos[huffman_io::RED][*utils::RED(lz77.output()[i].symbol)];
-				++histos[huffman_io::BLUE][*utils::BLUE(lz77.output()[i].symbol)];
-				++histos[huffman_io::ALPHA][*utils::ALPHA(lz77.output()[i].symbol)];
+	//буферы кодирования остаются между вызовами Encode: копия изображения под трансформации, разбор основного
+	//изображения и вложенных(трансформаций и entropy image), гистограммы тайлов и кластеров, мета коды Хаффмана
+	utils::pixel_array					m_image;
+	lz77_t								m_lz77;
+	lz77_t								m_sub_lz77;
+	std::vector<histogram::Histogram>	m_tiles;
+	std::vector<histogram::Histogram>	m_clusters;
+	MetaHuffmanCodes					m_codes;
+	static void AddToken(const lz77_t::token & token, histogram::Histogram & histo){
+		if (token.is_literal())
+			histo.add_literal(token.symbol());
+		else if (token.is_cache())
+			histo.add_cache(token.cache_key());
+		else
+			histo.add_copy(token.length_symbol(), token.dist_symbol());
+	}
+	/*
+	 * BuildHistograms
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит гистограммы символов для 5 кодов Хаффмана по токенам LZ77 из [begin, end)
+	 */
+	void BuildHistograms(const lz77_t::token_stream & tokens, const size_t & begin, const size_t & end, histogram::Histogram & histo) const{
+		histo.clear();
+		for(size_t i = begin; i < end; i++){
+			const lz77_t::token & token = tokens[i];
+			AddToken(token, histo);
+		}
+	}
+	/*
+	 * BuildHistograms
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит гистограммы символов для 5 кодов Хаффмана по токенам LZ77,
+	 * большие потоки токенов делятся на части, гистограммы которых строятся параллельно и складываются
+	 */
+	void BuildHistograms(const lz77_t::token_stream & tokens, histogram::Histogram & histo){
+		const size_t chunks_count = DIV_ROUND_UP(tokens.size(), HISTOGRAM_CHUNK_TOKENS);
+		if (chunks_count <= 1 || m_thread_pool.size() == 1){
+			BuildHistograms(tokens, 0, tokens.size(), histo);
+			return;
+		}
+		std::vector<histogram::Histogram> chunks(chunks_count, histo);
+		m_thread_pool.parallel_for(chunks_count, [&](size_t chunk){
+			const size_t begin = chunk * HISTOGRAM_CHUNK_TOKENS;
+			const size_t end = tokens.size() - begin < HISTOGRAM_CHUNK_TOKENS ? tokens.size() : begin + HISTOGRAM_CHUNK_TOKENS;
+			BuildHistograms(tokens, begin, end, chunks[chunk]);
+		});
+		histo.clear();
+		for(size_t chunk = 0; chunk < chunks_count; chunk++)
+			histo.add(chunks[chunk]);
+	}
+	/*
+	 * BuildTileHistograms
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит гистограммы для каждого тайла 1 << bits entropy image, токен относится к тайлу своего первого пикселя
+	 */
+	void BuildTileHistograms(const lz77_t::token_stream & tokens, const size_t & xsize, const uint32_t & bits, const size_t & huffman_xsize,
+								std::vector<histogram::Histogram> & tiles) const{
+		size_t x = 0, y = 0;
+		for(size_t i = 0; i < tokens.size(); i++){
+			const lz77_t::token & token = tokens[i];
+			histogram::Histogram & histo = tiles[(y >> bits) * huffman_xsize + (x >> bits)];
+			AddToken(token, histo);
+			x += token.pixels();
+			while(x >= xsize){
+				x -= xsize;
+				y++;
 			}
-			else{
-				symbol_t symbol;
-				size_t t1,t2;
-				lz77::prefix_coding_encode(lz77.output()[i].length, symbol, t1, t2);
-				++histos[huffman_io::GREEN][symbol + 256];
-
-
-				uint32_t dist_code = lz77::distance2dist_code(xsize, lz77.output()[i].distance);
-				lz77::prefix_coding_encode(dist_code, symbol, t1, t2);
-				++histos[huffman_io::DIST_PREFIX][symbol];
+		}
+	}
+	/*
+	 * WriteHuffmanCodes
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит и пишет по 5 кодов Хаффмана для каждой гистограммы
+	 */
+	void WriteHuffmanCodes(const std::vector<histogram::Histogram> & histos, MetaHuffmanCodes & codes){
+		histoarray histo;
+		codes.trees.realloc(histos.size() * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE);
+		for(size_t i = 0; i < histos.size(); i++)
+			for(size_t j = 0; j < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; j++){
+				huffman_coding::enc::HuffmanTree & tree = codes.trees[i * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE + j];
+				histos[i].to_histoarray(j, histo);
+				tree.build(histo, MAX_ENCODER_CODE_LENGTH, m_huffman_node_pool);
+				huffman_io::enc::VP8_LOSSLESS_HUFFMAN hio(&m_bit_writer, tree);
 			}
+	}
+	/*
+	 * WriteHuffmanCodedImage
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит и пишет 5 кодов Хаффмана, затем пишет сами токены
+	 */
+	void WriteHuffmanCodedImage(const lz77_t & lz77, const size_t & xsize, const uint32_t & color_cache_size = 0){
+		std::vector<histogram::Histogram> histos(1, histogram::Histogram(color_cache_size));
+		BuildHistograms(lz77.output(), histos[0]);
+		MetaHuffmanCodes codes;
+		WriteHuffmanCodes(histos, codes);
+		WriteLZ77CodedImage(codes, lz77, xsize);
+	}
+	/*
+	 * BuildMetaHistograms
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * делит изображение на тайлы 1 << huffman_bits, строит их гистограммы и объединяет их в кластеры.
+	 * Если entropy image не нужен или получился один кластер, codes.tile_codes остается пустым.
+	 * Размер entropy image считается от ширины изображения width, как в декодере
+	 */
+	void BuildMetaHistograms(const lz77_t & lz77, const size_t & xsize, const size_t & width, const size_t & height,
+								const uint32_t & color_cache_size, MetaHuffmanCodes & codes, std::vector<histogram::Histogram> & clusters){
+		codes.tile_codes.clear();
+		clusters.assign(1, histogram::Histogram(color_cache_size));
+		uint32_t huffman_bits = HuffmanImageBits[m_effort];
+		if (huffman_bits == 0){
+			BuildHistograms(lz77.output(), clusters[0]);
+			return;
 		}
-		huffman_coding::enc::HuffmanTree* trees[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE];
-		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++){
-			trees[i] = new huffman_coding::enc::HuffmanTree(histos[i], MAX_ALLOWED_CODE_LENGTH);
-			huffman_io::enc::VP8_LOSSLESS_HUFFMAN hio(&m_bit_writer, *trees[i]);
+		while(huffman_bits < HUFFMAN_IMAGE_MAX_BITS &&
+				DIV_ROUND_UP(width, 1 << huffman_bits) * DIV_ROUND_UP(height, 1 << huffman_bits) > HUFFMAN_IMAGE_MAX_TILES)
+			huffman_bits++;
+		codes.huffman_bits = huffman_bits;
+		codes.huffman_xsize = DIV_ROUND_UP(width, 1 << huffman_bits);
+		codes.huffman_ysize = DIV_ROUND_UP(height, 1 << huffman_bits);
+
+		m_tiles.assign(codes.huffman_xsize * codes.huffman_ysize, histogram::Histogram(color_cache_size));
+		BuildTileHistograms(lz77.output(), xsize, huffman_bits, codes.huffman_xsize, m_tiles);
+		histogram::ClusterHistograms(m_tiles, HUFFMAN_IMAGE_MAX_CLUSTERS, m_thread_pool, clusters, codes.tile_codes);
+		if (clusters.size() == 1)
+			codes.tile_codes.clear();
+	}
+	/*
+	 * WriteMetaHuffmanCodedImage
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * если кластеров гистограмм больше одного, пишет entropy image, затем по мета коду на кластер и сами токены
+	 */
+	void WriteMetaHuffmanCodedImage(const lz77_t & lz77, const size_t & xsize, const std::vector<histogram::Histogram> & clusters,
+									MetaHuffmanCodes & codes){
+		if (codes.tile_codes.empty())
+			m_bit_writer.WriteBit(0);//no huffman image
+		else{
+			VP8L_LOG("	Huffman image %ux%u, %u meta codes\n", (uint32_t)codes.huffman_xsize, (uint32_t)codes.huffman_ysize, (uint32_t)clusters.size());
+			m_bit_writer.WriteBit(1);//huffman image present
+			m_bit_writer.WriteBits(codes.huffman_bits - 2, 3);
+			//номер мета кода хранится в красной и зеленой компонентах
+			utils::pixel_array entropy_image(codes.tile_codes.size());
+			for(size_t i = 0; i < codes.tile_codes.size(); i++)
+				entropy_image[i] = 0xff000000 | (codes.tile_codes[i] << 8);
+			StageTimer timer(m_stats, "entropy image");
+			const size_t entropy_image_start = m_bit_writer.bit_size();
+			WriteEntropyCodedImage(codes.huffman_xsize, codes.huffman_ysize, entropy_image);
+			if (m_stats != NULL)
+				m_stats->entropy_image_bits += m_bit_writer.bit_size() - entropy_image_start;
+		}
+		StageTimer huffman_timer(m_stats, "huffman codes");
+		const size_t huffman_start = m_bit_writer.bit_size();
+		WriteHuffmanCodes(clusters, codes);
+		if (m_stats != NULL){
+			m_stats->huffman_codes += clusters.size() * HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE;
+			m_stats->huffman_header_bits += m_bit_writer.bit_size() - huffman_start;
 		}
-		WriteLZ77CodedImage(xsize, ysize, trees, lz77);
-		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
-			delete trees[i];
+		huffman_timer.stop();
+		StageTimer tokens_timer(m_stats, "write tokens");
+		WriteLZ77CodedImage(codes, lz77, xsize);
 	}
-	void WriteSpatiallyCodedImage(const size_t & xsize, const size_t & ysize, const utils::pixel_array & data){
-		m_bit_writer.WriteBit(0);//no color cache
-		m_bit_writer.WriteBit(0);//no huffman image
-		lz77::LZ77<uint32_t> lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH, data);
-
-		histoarray histos[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE] = { histoarray(256 + 24), histoarray(256), histoarray(256), histoarray(256), histoarray(40)};
-		for(size_t i = 0; i < lz77.output().size(); i++){
-			if (lz77.output()[i].length == 0 && lz77.output()[i].distance == 0){
-				++histos[huffman_io::GREEN][*utils::GREEN(lz77.output()[i].symbol)];
-				++histos[huffman_io::RED][*utils::RED(lz77.output()[i].symbol)];
-				++histos[huffman_io::BLUE][*utils::BLUE(lz77.output()[i].symbol)];
-				++histos[huffman_io::ALPHA][*utils::ALPHA(lz77.output()[i].symbol)];
+	/*
+	 * SelectColorCacheBits
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * за один проход по токенам для каждого размера цветового кэша 1..MAX_COLOR_CACHE_BITS строит гистограммы мета кодов
+	 * из codes, в которых литералы, найденные в кэше, заменены ссылками на кэш, и возвращает размер с наименьшей
+	 * оценкой стоимости, 0 - кэш не нужен.
+	 * Стоимость считается по всем мета кодам, потому что каждый из них платит за длины кодов ссылок на кэш
+	 */
+	uint32_t SelectColorCacheBits(const lz77_t::token_stream & tokens, const utils::pixel_array & data, const size_t & xsize,
+									const MetaHuffmanCodes & codes, const size_t & codes_count){
+		std::vector<float> costs(MAX_COLOR_CACHE_BITS + 1, 0.0f);
+		m_thread_pool.parallel_for(MAX_COLOR_CACHE_BITS + 1, [&](size_t bits){
+			std::vector<histogram::Histogram> histos(codes_count, histogram::Histogram(bits == 0 ? 0 : 1 << bits));
+			VP8_LOSSLESS_COLOR_CACHE color_cache(bits);
+			size_t pos = 0, x = 0, y = 0;
+			for(size_t i = 0; i < tokens.size(); i++){
+				const lz77_t::token & token = tokens[i];
+				histogram::Histogram & histo = histos[codes.code(x, y)];
+				if (token.is_literal() && bits != 0){
+					const uint32_t key = color_cache.key(token.symbol());
+					if (color_cache.get(key) == token.symbol())
+						histo.add_cache(key);
+					else
+						histo.add_literal(token.symbol());
+				}
+				else
+					AddToken(token, histo);
+				if (bits != 0)
+					for(const size_t end = pos + token.pixels(); pos < end; pos++)
+						color_cache.insert(data[pos]);
+				x += token.pixels();
+				while(x >= xsize){
+					x -= xsize;
+					y++;
+				}
 			}
-			else{
-				symbol_t symbol;
-				size_t t1,t2;
-				lz77::prefix_coding_encode(lz77.output()[i].length, symbol, t1, t2);
-				++histos[huffman_io::GREEN][symbol + 256];
-
-
-				uint32_t dist_code = lz77::distance2dist_code(xsize, lz77.output()[i].distance);
-				lz77::prefix_coding_encode(dist_code, symbol, t1, t2);
-				++histos[huffman_io::DIST_PREFIX][symbol];
+			for(size_t i = 0; i < histos.size(); i++)
+				costs[bits] += histos[i].cost();
+		});
+		uint32_t best = 0;
+		for(uint32_t bits = 1; bits <= MAX_COLOR_CACHE_BITS; bits++)
+			if (costs[bits] < costs[best])
+				best = bits;
+		return best;
+	}
+	/*
+	 * ApplyColorCache
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * заменяет литералы, которые декодер найдет в цветовом кэше размера 1 << bits, ссылками на кэш
+	 */
+	static void ApplyColorCache(lz77_t::token_stream & tokens, const utils::pixel_array & data, const uint32_t & bits){
+		VP8_LOSSLESS_COLOR_CACHE color_cache(bits);
+		size_t pos = 0;
+		for(size_t i = 0; i < tokens.size(); i++){
+			lz77_t::token & token = tokens[i];
+			const size_t end = pos + token.pixels();
+			if (token.is_literal()){
+				const uint32_t key = color_cache.key(token.symbol());
+				if (color_cache.get(key) == token.symbol())
+					token = lz77_t::token::cache(key);
 			}
+			for(; pos < end; pos++)
+				color_cache.insert(data[pos]);
 		}
-		huffman_coding::enc::HuffmanTree* trees[HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE];
-		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++){
-			trees[i] = new huffman_coding::enc::HuffmanTree(histos[i], MAX_ALLOWED_CODE_LENGTH);
-			huffman_io::enc::VP8_LOSSLESS_HUFFMAN hio(&m_bit_writer, *trees[i]);
-		}
-		WriteLZ77CodedImage(xsize, ysize, trees, lz77);
-		for(size_t i = 0; i < HUFFMAN_CODES_COUNT_IN_HUFFMAN_META_CODE; i++)
-			delete trees[i];
 	}
-	void WriteLZ77CodedImage(const size_t & xsize, const size_t & ysize, huffman_coding::enc::HuffmanTree ** trees,
-								const lz77::LZ77<uint32_t> & lz77){
-		for(size_t i = 0; i < lz77.output().size(); i++){
-			if (lz77.output()[i].length == 0 && lz77.output()[i].distance == 0){
-				symbol_t g = *utils::GREEN(lz77.output()[i].symbol);
-				symbol_t r = *utils::RED(lz77.output()[i].symbol);
-				symbol_t b = *utils::BLUE(lz77.output()[i].symbol);
-				symbol_t a = *utils::ALPHA(lz77.output()[i].symbol);
-
-				if (trees[huffman_io::GREEN]->get_num_nodes() > 1)
-					m_bit_writer.WriteBits(trees[huffman_io::GREEN]->get_codes()[g], trees[huffman_io::GREEN]->get_lengths()[g]);
-
-				if (trees[huffman_io::RED]->get_num_nodes() > 1)
-					m_bit_writer.WriteBits(trees[huffman_io::RED]->get_codes()[r], trees[huffman_io::RED]->get_lengths()[r]);
-
-				if (trees[huffman_io::BLUE]->get_num_nodes() > 1)
-					m_bit_writer.WriteBits(trees[huffman_io::BLUE]->get_codes()[b], trees[huffman_io::BLUE]->get_lengths()[b]);
+	/*
+	 * OptimizeLZ77
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * переупаковывает жадный разбор оптимальным по стоимостям символов, посчитанным по гистограмме жадного разбора
+	 * со ссылками на кэш размера 1 << color_cache_bits. Токены остаются без ссылок на кэш
+	 */
+	void OptimizeLZ77(lz77_t & lz77, const utils::pixel_array & data, const uint32_t & color_cache_bits){
+		if (color_cache_bits != 0)
+			ApplyColorCache(lz77.output(), data, color_cache_bits);
+		histogram::Histogram histo(color_cache_bits == 0 ? 0 : 1 << color_cache_bits);
+		BuildHistograms(lz77.output(), histo);
+		LZ77CostModel model(histo, data, color_cache_bits, LZ77_MAX_LENGTH);
+		lz77.optimize(data, model, &m_thread_pool);
+	}
+	void WriteEntropyCodedImage(const size_t & xsize, const size_t & ysize, const utils::pixel_array & data){
+		m_bit_writer.WriteBit(0);//no color cache
 
-				if (trees[huffman_io::ALPHA]->get_num_nodes() > 1)
-					m_bit_writer.WriteBits(trees[huffman_io::ALPHA]->get_codes()[a], trees[huffman_io::ALPHA]->get_lengths()[a]);
+		m_sub_lz77.pack(data, xsize, LZ77ChainDepth[m_effort], &m_thread_pool);
+		WriteHuffmanCodedImage(m_sub_lz77, xsize);
+	}
+	/*
+	 * BuildEntropyCodes
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * строит гистограммы мета кодов основного изображения, выбирает размер цветового кэша и заменяет литералы lz77
+	 * ссылками на кэш, на максимальном уровне сначала перестраивает разбор. Возвращает размер кэша, 0 - кэша нет
+	 */
+	uint32_t BuildEntropyCodes(lz77_t & lz77, const utils::pixel_array & data, const size_t & xsize, const size_t & width, const size_t & height,
+								MetaHuffmanCodes & codes, std::vector<histogram::Histogram> & clusters){
+		StageTimer timer(m_stats, "histograms");
+		BuildMetaHistograms(lz77, xsize, width, height, 0, codes, clusters);
+		const uint32_t color_cache_bits = m_effort == 0 ? 0 : SelectColorCacheBits(lz77.output(), data, xsize, codes, clusters.size());
+		if (m_effort >= ENCODER_OPTIMAL_PARSE_EFFORT){
+			StageTimer optimize_timer(m_stats, "optimal parse");
+			OptimizeLZ77(lz77, data, color_cache_bits);
+			timer.exclude(optimize_timer.stop());
+			if (color_cache_bits == 0)
+				BuildMetaHistograms(lz77, xsize, width, height, 0, codes, clusters);
+		}
+		if (color_cache_bits != 0){
+			VP8L_LOG("	Color cache bits=%u\n", color_cache_bits);
+			ApplyColorCache(lz77.output(), data, color_cache_bits);
+			//ссылки на кэш меняют гистограммы, кластеры строятся заново
+			BuildMetaHistograms(lz77, xsize, width, height, 1 << color_cache_bits, codes, clusters);
+		}
+		return color_cache_bits;
+	}
+	void WriteSpatiallyCodedImage(const size_t & xsize, const size_t & width, const size_t & height, const utils::pixel_array & data){
+		const size_t image_start = m_bit_writer.bit_size();
+		const uint64_t entropy_image_bits = m_stats == NULL ? 0 : m_stats->entropy_image_bits;
+		StageTimer lz77_timer(m_stats, "lz77");
+		m_lz77.pack(data, xsize, LZ77ChainDepth[m_effort], &m_thread_pool);
+		lz77_timer.stop();
+		const uint32_t color_cache_bits = BuildEntropyCodes(m_lz77, data, xsize, width, height, m_codes, m_clusters);
+		if (color_cache_bits == 0)
+			m_bit_writer.WriteBit(0);//no color cache
+		else{
+			m_bit_writer.WriteBit(1);
+			m_bit_writer.WriteBits(color_cache_bits, 4);
+		}
+		WriteMetaHuffmanCodedImage(m_lz77, xsize, m_clusters, m_codes);
+		if (m_stats != NULL){
+			const lz77_t::token_stream & tokens = m_lz77.output();
+			for(size_t i = 0; i < tokens.size(); i++)
+				if (tokens[i].is_literal())
+					m_stats->literals++;
+				else if (tokens[i].is_cache())
+					m_stats->cache_hits++;
+				else{
+					m_stats->copies++;
+					m_stats->copied_pixels += tokens[i].length();
+				}
+			m_stats->main_image_bits += m_bit_writer.bit_size() - image_start - (m_stats->entropy_image_bits - entropy_image_bits);
+		}
+	}
+	void WriteSymbol(const huffman_coding::enc::HuffmanTree & tree, const symbol_t & symbol){
+		//если символ в коде один, декодер читает его за 0 бит
+		if (tree.get_num_nodes() > 1)
+			m_bit_writer.WriteBits(tree.get_codes()[symbol], tree.get_lengths()[symbol]);
+	}
+	void WriteLZ77CodedImage(const MetaHuffmanCodes & codes, const lz77_t & lz77, const size_t & xsize){
+		const lz77_t::token_stream & tokens = lz77.output();
+		size_t x = 0, y = 0;
+		for(size_t i = 0; i < tokens.size(); i++){
+			const lz77_t::token & token = tokens[i];
+			const huffman_coding::enc::HuffmanTree * trees = codes.select(x, y);
+			if (token.is_literal()){
+				const uint32_t argb = token.symbol();
+				WriteSymbol(trees[huffman_io::GREEN], (argb >> 8) & 0xff);
+				WriteSymbol(trees[huffman_io::RED], (argb >> 16) & 0xff);
+				WriteSymbol(trees[huffman_io::BLUE], argb & 0xff);
+				WriteSymbol(trees[huffman_io::ALPHA], argb >> 24);
 			}
+			else if (token.is_cache())
+				WriteSymbol(trees[huffman_io::GREEN], 256 + 24 + token.cache_key());
 			else{
-				symbol_t g;
-				size_t extra_bits_count, extra_bits;
-				lz77::prefix_coding_encode(lz77.output()[i].length, g, extra_bits_count, extra_bits);
-				m_bit_writer.WriteBits(trees[huffman_io::GREEN]->get_codes()[g + 256], trees[huffman_io::GREEN]->get_lengths()[g + 256]);
+				uint32_t extra_bits_count, extra_bits;
+				WriteSymbol(trees[huffman_io::GREEN], token.length_symbol() + 256);
+				lz77::prefix_coding_extra_bits(token.length(), token.length_symbol(), extra_bits_count, extra_bits);
 				if (extra_bits_count > 0)
 					m_bit_writer.WriteBits(extra_bits, extra_bits_count);
 
-				symbol_t dist;
-				uint32_t dist_code = lz77::distance2dist_code(xsize, lz77.output()[i].distance);
-				lz77::prefix_coding_encode(dist_code, dist, extra_bits_count, extra_bits);
-				if (trees[huffman_io::DIST_PREFIX]->get_num_nodes() > 1)
-					m_bit_writer.WriteBits(trees[huffman_io::DIST_PREFIX]->get_codes()[dist], trees[huffman_io::DIST_PREFIX]->get_lengths()[dist]);
+				WriteSymbol(trees[huffman_io::DIST_PREFIX], token.dist_symbol());
+				lz77::prefix_coding_extra_bits(token.dist_code(), token.dist_symbol(), extra_bits_count, extra_bits);
 				if (extra_bits_count > 0)
 					m_bit_writer.WriteBits(extra_bits, extra_bits_count);
 			}
+			x += token.pixels();
+			while(x >= xsize){
+				x -= xsize;
+				y++;
+			}
 		}
 	}
 public:
-	VP8_LOSSLESS_ENCODER(const utils::pixel_array & argb_image, const size_t & width, const size_t & height)
+	VP8_LOSSLESS_ENCODER(const utils::pixel_array & argb_image, const size_t & width, const size_t & height,
+							const uint32_t & effort = ENCODER_DEFAULT_EFFORT, const size_t & threads = 0, Stats * stats = NULL)
+		: m_effort(effort > ENCODER_MAX_EFFORT ? ENCODER_MAX_EFFORT : effort),
+		  m_thread_pool(threads == 0 ? utils::ThreadPool::hardware_threads() : threads), m_stats(NULL),
+		  m_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH), m_sub_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH)
 	{
+		Encode(argb_image, width, height, stats);
+	}
+	/*
+	 * Кодировщик без изображения: изображения кодируются вызовами Encode, пул потоков и буферы переиспользуются
+	 * между ними, либо стадии вызываются по отдельности(см. webp_bench)
+	 */
+	VP8_LOSSLESS_ENCODER(const uint32_t & effort, const size_t & threads)
+		: m_effort(effort > ENCODER_MAX_EFFORT ? ENCODER_MAX_EFFORT : effort),
+		  m_thread_pool(threads == 0 ? utils::ThreadPool::hardware_threads() : threads), m_stats(NULL),
+		  m_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH), m_sub_lz77(LZ77_MAX_DISTANCE, LZ77_MAX_LENGTH)
+	{
+
+	}
+	/*
+	 * Encode
+	 * Бросает исключения: TooBigARGBImage, InvalidARGBImage
+	 * Назначение:
+	 * кодирует изображение в get_bit_writer() заново, если stats != NULL, заполняет статистику кодирования
+	 */
+	void Encode(const utils::pixel_array & argb_image, const size_t & width, const size_t & height, Stats * stats = NULL){
 		if (argb_image.size() == 0 || width == 0 || height == 0)
 			throw exception::InvalidARGBImage();
 		if (width > MAX_ARGB_IMAGE_SIZE || height > MAX_ARGB_IMAGE_SIZE)
 			throw exception::TooBigARGBImage(MAX_ARGB_IMAGE_SIZE);
-		printf("Encoding ARGB Image %ux%u %u bytes\n", width, height, argb_image.size() * 4);
+		m_stats = stats;
+		m_bit_writer.clear();
+		VP8L_LOG("Encoding ARGB Image %ux%u %u bytes\n", width, height, argb_image.size() * 4);
 		write_info(width, height);
-
-		palette_t palette;
-		utils::pixel_array image(argb_image);
-		CreatePallete(image, palette);
+		const size_t transforms_start = m_bit_writer.bit_size();
+		m_image.realloc(argb_image.size());
+		memcpy(&m_image[0], &argb_image[0], argb_image.size() * sizeof(uint32_t));
+		const size_t xsize = ApplyTransforms(width, height, m_image);
+		VP8L_LOG("No more transforms\nWriting spatially coded image..\n");
+		m_bit_writer.WriteBit(0);//no transform
+		if (m_stats != NULL)
+			m_stats->transform_bits += m_bit_writer.bit_size() - transforms_start;
+		WriteSpatiallyCodedImage(xsize, width, height, m_image);
+		VP8L_LOG("Done, VP8L Encoded stream length %u\n", m_bit_writer.size());
+	}
+	/*
+	 * ApplyTransforms
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * выбирает и применяет к image трансформации, записывая их в поток. Возвращает ширину image после них:
+	 * при палитре из <= 16 цветов индексы нескольких пикселей упакованы в один
+	 */
+	size_t ApplyTransforms(const size_t & width, const size_t & height, utils::pixel_array & image){
+		PaletteHash palette;
+		StageTimer palette_timer(m_stats, "palette");
+		palette.build(image);
+		palette_timer.stop();
 		size_t _width = width;
 		if (palette.size() == 0){//палитры нет
+			StageTimer timer(m_stats, "subtract green");
 			ApplySubtractGreenTransform(image);
+			timer.stop();
+			if (m_effort > 0){
+				StageTimer predictor_timer(m_stats, "predictor");
+				ApplyPredictorTransform(width, height, image);
+				predictor_timer.stop();
+				StageTimer cross_color_timer(m_stats, "cross color");
+				ApplyCrossColorTransform(width, height, image);
+			}
 		}
 		else{//палитра есть
-			utils::pixel_array palette_array(palette.size());
-			size_t i = 0;
-			for (palette_t::iterator iter = palette.begin(); iter != palette.end(); ++iter)
-				palette_array[i++] = *iter;
-			_width = ApplyColorIndexingTransform(width, height, palette_array, image);
+			StageTimer timer(m_stats, "color indexing");
+			utils::pixel_array palette_array;
+			palette.sorted(palette_array);
+			_width = ApplyColorIndexingTransform(width, height, palette_array, palette, image);
 		}
-		printf("No more transforms\nWriting spatially coded image..\n");
-		m_bit_writer.WriteBit(0);//no transform
-		WriteSpatiallyCodedImage(_width, height, image);
-		printf("Done, VP8L Encoded stream length %u\n", m_bit_writer.size());
+		return _width;
 	}
 	const utils::BitWriter & get_bit_writer(){
 		return m_bit_writer;
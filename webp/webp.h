@@ -7,6 +7,7 @@
 #include <png.h>
 
 #define WEBP_FILE_HEADER_LENGTH 12
+#define WEBP_CHUNK_HEADER_LENGTH 8
 
 namespace webp
 {
@@ -17,6 +18,114 @@ enum FILE_FORMAT
 	FILE_FORMAT_LOSSLESS
 };
 
+/*
+ * Приемник строк, который сразу пишет их в PNG файл, изображение целиком в памяти не хранится.
+ * Ошибки libpng приходят через longjmp, поэтому setjmp ставится в каждом методе, который вызывает libpng.
+ * Если до разрушения записаны не все строки(поток оказался испорчен), недописанный файл удаляется
+ */
+class PNG_ROW_WRITER : public vp8l::VP8_LOSSLESS_ROW_SINK
+{
+private:
+	std::string				m_file_name;
+	FILE *					m_fp;
+	png_structp				m_png;
+	png_infop				m_info;
+	uint32_t				m_width;
+	uint32_t				m_height;
+	utils::array<uint8_t>	m_rgb_row;
+	//файл создан и еще не дописан до конца
+	bool					m_incomplete;
+	PNG_ROW_WRITER(const PNG_ROW_WRITER &);
+	PNG_ROW_WRITER & operator=(const PNG_ROW_WRITER &);
+	void release()
+	{
+		if (m_png != NULL)
+			png_destroy_write_struct(&m_png, m_info == NULL ? NULL : &m_info);
+		m_png = NULL;
+		m_info = NULL;
+		if (m_fp != NULL)
+			fclose(m_fp);
+		m_fp = NULL;
+	}
+public:
+	PNG_ROW_WRITER(const std::string & file_name)
+		: m_file_name(file_name), m_fp(NULL), m_png(NULL), m_info(NULL), m_width(0), m_height(0), m_incomplete(false)
+	{
+
+	}
+	void begin(const uint32_t & width, const uint32_t & height)
+	{
+		m_width = width;
+		m_height = height;
+		m_rgb_row.realloc(width * 3);
+		m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (m_png == NULL)
+			throw exception::PNGError();
+
+		m_info = png_create_info_struct(m_png);
+		if (m_info == NULL)
+		{
+			release();
+			throw exception::PNGError();
+		}
+
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			release();
+			throw exception::PNGError();
+		}
+
+		#ifdef LINUX
+		  m_fp = fopen(m_file_name.c_str(), "wb");
+		#endif
+		#ifdef WINDOWS
+		  fopen_s(&m_fp, m_file_name.c_str(), "wb");
+		#endif
+		if (m_fp == NULL)
+		{
+			release();
+			throw exception::FileOperationException();
+		}
+		m_incomplete = true;
+		png_init_io(m_png, m_fp);
+		png_set_IHDR(m_png, m_info, m_width, m_height, 8,
+			   PNG_COLOR_TYPE_RGB,
+			   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			   PNG_FILTER_TYPE_DEFAULT);
+		png_write_info(m_png, m_info);
+	}
+	void row(const uint32_t & y, const uint32_t * argb)
+	{
+		if (m_png == NULL)
+			throw exception::PNGError();
+		for(size_t x = 0; x < m_width; x++)
+		{
+			m_rgb_row[x * 3]     = (argb[x] >> 16) & 0x000000ff;
+			m_rgb_row[x * 3 + 1] = (argb[x] >> 8) & 0x000000ff;
+			m_rgb_row[x * 3 + 2] = (argb[x] >> 0) & 0x000000ff;
+		}
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			release();
+			throw exception::PNGError();
+		}
+		png_bytep row = m_rgb_row + 0;
+		png_write_rows(m_png, &row, 1);
+		if (y + 1 == m_height)
+		{
+			png_write_end(m_png, m_info);
+			release();
+			m_incomplete = false;
+		}
+	}
+	virtual ~PNG_ROW_WRITER()
+	{
+		release();
+		if (m_incomplete)
+			remove(m_file_name.c_str());
+	}
+};
+
 class WebP_DECODER
 {
 private:
@@ -42,105 +151,124 @@ private:
 			throw exception::InvalidWebPFileFormat();
 		*iterable_pointer += 4;
 	}
-	void init(utils::array<uint8_t> & encoded_data)
+	/*
+	 * init
+	 * Бросает исключения: InvalidWebPFileFormat, UnsupportedVP8, InvalidVP8L, InvalidHuffman
+	 * Назначение:
+	 * проходит по чанкам RIFF прямо в переданном буфере и декодирует чанк VP8L без копирования,
+	 * строки передаются в sink. Чанки, отличные от VP8 и VP8L, пропускаются. Если stats != NULL, в нее пишется статистика декодирования.
+	 * Поток VP8L декодирует decoder, его буферы переиспользуются между файлами
+	 */
+	void init(const uint8_t * data, const size_t & data_length, vp8l::VP8_LOSSLESS_ROW_SINK & sink,
+				vp8l::VP8_LOSSLESS_DECODER & decoder, vp8l::Stats * stats)
 	{
+		if (data == NULL || data_length < WEBP_FILE_HEADER_LENGTH + WEBP_CHUNK_HEADER_LENGTH)
+			throw exception::InvalidWebPFileFormat();
 		//чтобы бегать по данным и не потерять указатель на начало буфера
-		const uint8_t * iterable_pointer = &encoded_data[0];
+		const uint8_t * iterable_pointer = data;
 		read_webp_file_header(&iterable_pointer);
 
-		if (memcmp(iterable_pointer, "VP8 ", 4) == 0)
-			m_file_format = FILE_FORMAT_LOSSY;
-		else if (memcmp(iterable_pointer, "VP8L", 4) == 0)
-			m_file_format = FILE_FORMAT_LOSSLESS;
-		else
-			throw exception::UnsupportedVP8();
-		iterable_pointer += 4;
-
-		//m_file_size это размер файла - 8(из заголовка RIFF(4 байта) и file_size(4 байта)),
-		//data_length это m_file_size - 8(из заголовка WEBP(4 байта) и VP8_(4 байта))
-		uint32_t vp8_data_length = m_file_size - 8;
-		utils::array<uint8_t> vp8_data(vp8_data_length);
-		memcpy(&vp8_data[0], iterable_pointer, vp8_data_length);
-		if (m_file_format == FILE_FORMAT_LOSSLESS)
+		//m_file_size это размер файла - 8(из заголовка RIFF(4 байта) и file_size(4 байта))
+		if (m_file_size < 4 || m_file_size > data_length - 8)
+			throw exception::InvalidWebPFileFormat();
+		const uint8_t * riff_end = data + 8 + m_file_size;
+
+		while(riff_end - iterable_pointer >= WEBP_CHUNK_HEADER_LENGTH)
 		{
-			vp8l::VP8_LOSSLESS_DECODER decoder(&vp8_data[0], vp8_data_length, m_argb_image);
-			m_image_width = decoder.image_width();
-			m_image_height = decoder.image_height();
+			const uint8_t * fourcc = iterable_pointer;
+			uint32_t chunk_size;
+			memcpy(&chunk_size, iterable_pointer + 4, sizeof(uint32_t));
+			if (memcmp(fourcc, "VP8 ", 4) == 0)
+			{
+				m_file_format = FILE_FORMAT_LOSSY;
+				throw exception::UnsupportedVP8();
+			}
+			if (memcmp(fourcc, "VP8L", 4) == 0)
+			{
+				m_file_format = FILE_FORMAT_LOSSLESS;
+				//декодер VP8L сам читает размер чанка первыми 32 битами потока.
+				//Размер 0 пишут старые версии кодировщика, тогда поток идет до конца RIFF
+				const uint8_t * stream = iterable_pointer + 4;
+				size_t stream_length = riff_end - stream;
+				if (chunk_size != 0)
+				{
+					if (chunk_size > stream_length - 4)
+						throw exception::InvalidWebPFileFormat();
+					stream_length = chunk_size + 4;
+				}
+				decoder.Decode(stream, stream_length, sink, stats);
+				m_image_width = decoder.image_width();
+				m_image_height = decoder.image_height();
+				return;
+			}
+			//чанки выровнены на 2 байта
+			const size_t padded_size = (size_t)chunk_size + (chunk_size & 1);
+			if (padded_size > (size_t)(riff_end - iterable_pointer) - WEBP_CHUNK_HEADER_LENGTH)
+				throw exception::InvalidWebPFileFormat();
+			iterable_pointer += WEBP_CHUNK_HEADER_LENGTH + padded_size;
 		}
-		else
-			throw exception::UnsupportedVP8();
+		throw exception::UnsupportedVP8();
 	}
 public:
-	WebP_DECODER(const std::string & file_name)
+	/*
+	 * Декодирует файл целиком в память, см. save2png. Файл отображается в память, а не читается
+	 */
+	WebP_DECODER(const std::string & file_name, vp8l::Stats * stats = NULL)
 	{
-		uint32_t file_length;
-		utils::array<uint8_t> buf;
-		utils::read_file(file_name, file_length, buf);
-		if (file_length < WEBP_FILE_HEADER_LENGTH)
-			throw exception::InvalidWebPFileFormat();
-		init(buf);
+		utils::MappedFile file(file_name);
+		vp8l::VP8_LOSSLESS_IMAGE_SINK sink(m_argb_image);
+		vp8l::VP8_LOSSLESS_DECODER decoder;
+		init(file.data(), file.size(), sink, decoder, stats);
+	}
+	/*
+	 * Декодирует файл, передавая строки в sink по мере готовности, изображение целиком не хранится
+	 */
+	WebP_DECODER(const std::string & file_name, vp8l::VP8_LOSSLESS_ROW_SINK & sink, vp8l::Stats * stats = NULL)
+	{
+		utils::MappedFile file(file_name);
+		vp8l::VP8_LOSSLESS_DECODER decoder;
+		init(file.data(), file.size(), sink, decoder, stats);
+	}
+	/*
+	 * Аналогично, но поток декодирует переданный decoder, который переиспользует свои буферы от файла к файлу
+	 */
+	WebP_DECODER(const std::string & file_name, vp8l::VP8_LOSSLESS_ROW_SINK & sink, vp8l::VP8_LOSSLESS_DECODER & decoder,
+					vp8l::Stats * stats = NULL)
+	{
+		utils::MappedFile file(file_name);
+		init(file.data(), file.size(), sink, decoder, stats);
+	}
+	/*
+	 * Декодирует WebP из буфера в памяти целиком, буфер не копируется
+	 */
+	WebP_DECODER(const uint8_t * data, const size_t & data_length, vp8l::Stats * stats = NULL)
+	{
+		vp8l::VP8_LOSSLESS_IMAGE_SINK sink(m_argb_image);
+		vp8l::VP8_LOSSLESS_DECODER decoder;
+		init(data, data_length, sink, decoder, stats);
+	}
+	/*
+	 * Декодирует WebP из буфера в памяти, передавая строки в sink, буфер не копируется
+	 */
+	WebP_DECODER(const uint8_t * data, const size_t & data_length, vp8l::VP8_LOSSLESS_ROW_SINK & sink, vp8l::Stats * stats = NULL)
+	{
+		vp8l::VP8_LOSSLESS_DECODER decoder;
+		init(data, data_length, sink, decoder, stats);
 	}
 	void save2png(const std::string & file_name)
 	{
-		int i =0;
-		//uint8_t * rgb = new uint8_t[m_image_height * m_image_width * 3];
-		utils::array<uint8_t> rgb(m_image_height * m_image_width * 3);
-		for(size_t y = 0; y < m_image_height; y++)
-			for(size_t x = 0; x < m_image_width; x++)
-			{
-				size_t j = y * m_image_width + x;
-				rgb[i++] = (m_argb_image[j] >> 16) & 0x000000ff;
-				rgb[i++] = (m_argb_image[j] >> 8) & 0x000000ff;
-				rgb[i++] = (m_argb_image[j] >> 0) & 0x000000ff;
-			}
-
-		png_structp png;
-		png_infop info;
-		png_uint_32 y;
-
-		png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-		if (png == NULL)
-			throw exception::PNGError();
-
-		info = png_create_info_struct(png);
-		if (info == NULL)
-		{
-			png_destroy_write_struct(&png, NULL);
-			throw exception::PNGError();
-		}
-
-		if (setjmp(png_jmpbuf(png)))
-		{
-			png_destroy_write_struct(&png, &info);
-			throw exception::PNGError();
-		}
-		FILE * fp = NULL;
-
-		#ifdef LINUX
-		  fp = fopen(file_name.c_str(), "wb");
-		#endif
-		#ifdef WINDOWS
-		  fopen_s(&fp, file_name.c_str(), "wb");
-		#endif
-		if (fp == NULL)
-		{
-			png_destroy_write_struct(&png, &info);
-			throw exception::FileOperationException();
-		}
-		png_init_io(png, fp);
-		png_set_IHDR(png, info, m_image_width, m_image_height, 8,
-			   PNG_COLOR_TYPE_RGB,
-			   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-			   PNG_FILTER_TYPE_DEFAULT);
-		png_write_info(png, info);
-		for (y = 0; y < m_image_height; ++y)
-		{
-			png_bytep row = rgb + y * m_image_width * 3;
-			png_write_rows(png, &row, 1);
-		}
-		png_write_end(png, info);
-		png_destroy_write_struct(&png, &info);
-		fclose(fp);
+		if (m_argb_image.size() == 0)
+			throw exception::InvalidARGBImage();
+		PNG_ROW_WRITER png(file_name);
+		png.begin(m_image_width, m_image_height);
+		for(uint32_t y = 0; y < m_image_height; y++)
+			png.row(y, &m_argb_image[y * m_image_width]);
+	}
+	const uint32_t image_width(){
+		return m_image_width;
+	}
+	const uint32_t image_height(){
+		return m_image_height;
 	}
 	virtual ~WebP_DECODER()
 	{
@@ -149,12 +277,80 @@ public:
 };
 
 
+/*
+ * Кодирует изображение в память: после конструктора data()/size() содержат файл WebP целиком
+ * (RIFF + чанк VP8L) с заполненными размерами, файловая система не используется
+ */
 class WebP_ENCODER{
-public:
-	WebP_ENCODER(const utils::pixel_array & argb_image, const size_t & width, const size_t & height, const std::string & output)
+private:
+	utils::byte_array	m_data;
+	WebP_ENCODER(const WebP_ENCODER &);
+	WebP_ENCODER & operator=(const WebP_ENCODER &);
+	/*
+	 * encode
+	 * Бросает исключения: TooBigARGBImage, InvalidARGBImage
+	 * Назначение:
+	 * собирает RIFF заголовок и поток VP8L в m_data.
+	 * Первые 32 бита потока VP8L кодировщик оставляет под размер чанка, здесь они заполняются.
+	 * Поток VP8L кодирует encoder, его пул потоков и буферы переиспользуются между изображениями
+	 */
+	void encode(vp8l::VP8_LOSSLESS_ENCODER & encoder, const utils::pixel_array & argb_image, const size_t & width, const size_t & height,
+					vp8l::Stats * stats)
 	{
-		vp8l::VP8_LOSSLESS_ENCODER encoder(argb_image, width, height);
+		encoder.Encode(argb_image, width, height, stats);
+		const utils::BitWriter & bit_writer = encoder.get_bit_writer();
+
+		const uint32_t chunk_size = bit_writer.size() - 4;
+		//чанки RIFF выровнены на 2 байта
+		const uint32_t padding = chunk_size & 1;
+		const uint32_t riff_size = 4 + WEBP_CHUNK_HEADER_LENGTH + chunk_size + padding;
 
+		m_data.realloc(8 + riff_size);
+		uint8_t * out = m_data + 0;
+		memcpy(out, "RIFF", 4);
+		memcpy(out + 4, &riff_size, sizeof(uint32_t));
+		memcpy(out + 8, "WEBP", 4);
+		memcpy(out + 12, "VP8L", 4);
+		memcpy(out + 16, bit_writer.data(), bit_writer.size());
+		memcpy(out + 16, &chunk_size, sizeof(uint32_t));
+		if (padding != 0)
+			out[m_data.size() - 1] = 0;
+	}
+public:
+	WebP_ENCODER(const utils::pixel_array & argb_image, const size_t & width, const size_t & height,
+					const uint32_t & effort = ENCODER_DEFAULT_EFFORT, const size_t & threads = 0, vp8l::Stats * stats = NULL)
+	{
+		vp8l::VP8_LOSSLESS_ENCODER encoder(effort, threads);
+		encode(encoder, argb_image, width, height, stats);
+	}
+	/*
+	 * Кодирует и сразу сохраняет в файл output
+	 */
+	WebP_ENCODER(const utils::pixel_array & argb_image, const size_t & width, const size_t & height, const std::string & output,
+					const uint32_t & effort = ENCODER_DEFAULT_EFFORT, const size_t & threads = 0, vp8l::Stats * stats = NULL)
+	{
+		vp8l::VP8_LOSSLESS_ENCODER encoder(effort, threads);
+		encode(encoder, argb_image, width, height, stats);
+		save2file(output);
+	}
+	/*
+	 * Кодирует переданным encoder, который хранит уровень сжатия, пул потоков и буферы между изображениями,
+	 * и сразу сохраняет в файл output
+	 */
+	WebP_ENCODER(vp8l::VP8_LOSSLESS_ENCODER & encoder, const utils::pixel_array & argb_image, const size_t & width, const size_t & height,
+					const std::string & output, vp8l::Stats * stats = NULL)
+	{
+		encode(encoder, argb_image, width, height, stats);
+		save2file(output);
+	}
+	/*
+	 * save2file
+	 * Бросает исключения: FileOperationException
+	 * Назначение:
+	 * записывает закодированный файл одним вызовом fwrite
+	 */
+	void save2file(const std::string & output) const
+	{
 		FILE * fp = NULL;
 		#ifdef LINUX
 		  fp = fopen(output.c_str(), "wb");
@@ -164,13 +360,31 @@ public:
 		#endif
 		if (fp == NULL)
 			throw exception::FileOperationException();
-		fwrite("RIFF", 1, 4, fp);
-		uint32_t filesize = encoder.get_bit_writer().size() + 8;
-		fwrite(&filesize, 4, 1, fp);
-		fwrite("WEBP", 1, 4, fp);
-		fwrite("VP8L", 1, 4, fp);
-		fclose(fp);
-		encoder.get_bit_writer().save2file(output);
+		const size_t written = fwrite(data(), 1, size(), fp);
+		if (fclose(fp) != 0 || written != size())
+			throw exception::FileOperationException();
+	}
+	const uint8_t * data() const
+	{
+		return &m_data[0];
+	}
+	const size_t & size() const
+	{
+		return m_data.size();
+	}
+	/*
+	 * move_data
+	 * Бросает исключения: нет
+	 * Назначение:
+	 * отдает буфер с файлом в out без копирования, после вызова кодировщик пуст
+	 */
+	void move_data(utils::byte_array & out)
+	{
+		out.move_ref(m_data);
+	}
+	virtual ~WebP_ENCODER()
+	{
+
 	}
 };
 